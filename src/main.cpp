@@ -29,6 +29,7 @@
 
 #define Window_w 640
 #define Window_h 480
+#define UPLOAD_BUDGET_MS 4.0    // Texture upload time per frame while loading progressively
 
 // Global variable
 GLuint g_shaderProgram, g_RGBAShaderProgram, g_PalettedShaderProgram;
@@ -273,6 +274,7 @@ int exportAllSpriteAsPNG(Sff& sff) {
     //Iterate through all sprites and export them as PNG
     for (size_t i = 0; i < sff.header.NumberOfSprites; ++i) {
         Sprite& spr = sff.sprites[i];
+        getSpriteTexture(sff, i);
         snprintf(png_filename, sizeof(png_filename), "%s %d_%d.png", basename.c_str(), spr.Group, spr.Number);
         printf("Exporting %s\n", png_filename);
 
@@ -292,6 +294,7 @@ int exportAllSpriteAsPNG(Sff& sff) {
 
 int exportCurrentSpriteAsPNG(Sff& sff, int64_t spr_idx) {
     Sprite& spr = sff.sprites[spr_idx];
+    getSpriteTexture(sff, spr_idx);
     GLuint pal_texture_id = sff.palettes[spr.palidx].texture_id;
     char png_filename[256];
     std::string basename = getFilenameNoExt(sff.filename);
@@ -375,72 +378,21 @@ int exportAllSpriteAsAtlas(Sff& sff) {
             continue; // Skip sprites with different palette index
         }
 
-        unsigned char* p_img = copyRawImageFromSprite(spr);
+        // Decoding the sprite gives the box of its non-transparent pixels
+        getSpriteTexture(sff, i);
         int64_t sw = spr.Size[0];
         int64_t sh = spr.Size[1];
-        size_t pitch = sw;
         // fprintf(stderr, "Packing spr[%lld] %u,%u %llux%llu (%d,%d) pal=%d rle=%d\n", i, spr.Group, spr.Number, sw, sh, spr.Offset[0], spr.Offset[1], spr.palidx, spr.rle);
 
-        spr.atlas_x = 0;
-        spr.atlas_y = 0;
-
         if (sw > (int64_t) maxw) maxw = sw;
         if (sh > (int64_t) maxh) maxh = sh;
         prod += sw * sh;
 
-        // Crop top
-        while (sh > 0) {
-            int empty = 1;
-            for (int64_t x = 0; x < sw; x++) {
-                if (p_img[x + spr.atlas_y * pitch]) {
-                    empty = 0;
-                    break;
-                }
-            }
-            if (!empty) break;
-            spr.atlas_y++;
-            sh--;
-        }
-
-        // Crop bottom
-        while (sh > 0) {
-            int empty = 1;
-            for (int64_t x = 0; x < sw; x++) {
-                if (p_img[x + (spr.atlas_y + sh - 1) * pitch]) {
-                    empty = 0;
-                    break;
-                }
-            }
-            if (!empty) break;
-            sh--;
-        }
-
-        // Crop left
-        while (sw > 0) {
-            int empty = 1;
-            for (int64_t y = 0; y < sh; y++) {
-                if (p_img[(spr.atlas_y + y) * pitch + spr.atlas_x]) {
-                    empty = 0;
-                    break;
-                }
-            }
-            if (!empty) break;
-            spr.atlas_x++;
-            sw--;
-        }
-
-        // Crop right
-        while (sw > 0) {
-            int empty = 1;
-            for (int64_t y = 0; y < sh; y++) {
-                if (p_img[(spr.atlas_y + y) * pitch + spr.atlas_x + sw - 1]) {
-                    empty = 0;
-                    break;
-                }
-            }
-            if (!empty) break;
-            sw--;
-        }
+        // Crop to the bounds
+        spr.atlas_x = spr.Bounds[0];
+        spr.atlas_y = spr.Bounds[1];
+        sw = spr.hasBounds ? spr.Bounds[2] : 0;
+        sh = spr.hasBounds ? spr.Bounds[3] : 0;
 
         if (sw < 1 || sh < 1) {
             sw = sh = spr.atlas_x = spr.atlas_y = 0;
@@ -449,8 +401,6 @@ int exportAllSpriteAsAtlas(Sff& sff) {
         atlas.rects[i].id = i;
         atlas.rects[i].w = sw;
         atlas.rects[i].h = sh;
-
-        if (p_img) free(p_img);
     }
 
     fprintf(stderr, "Atlas Max width: %zu, Max height: %zu\n", maxw, maxh);
@@ -525,6 +475,7 @@ int exportAllSpriteAsAtlas(Sff& sff) {
             continue; // Skip sprites with different palette index
         }
 
+        getSpriteTexture(sff, i);
         unsigned char* raw_image_data = copyRawImageFromSprite(spr);
         char filename[256];
         snprintf(filename, sizeof(filename), "%d_%d", spr.Group, spr.Number);
@@ -562,8 +513,7 @@ int exportAllSpriteAsAtlas(Sff& sff) {
 
     // Prepare for saving the atlas as PNG
     snprintf(out_filename, sizeof(out_filename), "sprite_atlas_%s.png", basename.c_str());
-    LodePNGState state;
-    lodepng_state_init(&state);
+    LodePNGState& state = pngEncodeState();
 
     // Set color type to palette
     state.info_raw.colortype = LCT_PALETTE;
@@ -593,8 +543,7 @@ int exportAllSpriteAsAtlas(Sff& sff) {
     } else {
         fprintf(stderr, "Error encoding PNG data: %s\n", lodepng_error_text(err_code));
     }
-    lodepng_state_cleanup(&state);
-    free(png);
+    lodepng_free(png);
     free(output);
     return err_code;
 }
@@ -731,8 +680,26 @@ std::vector<char> getSpriteStatistics(Sff& sff) {
     ss_output << "SFF Version: " << (int) sff.header.Ver0 << "." << (int) sff.header.Ver1 << "." << (int) sff.header.Ver2 << "." << (int) sff.header.Ver3 << "\n\n";
     ss_output << "Total Sprites: " << sff.header.NumberOfSprites << "\n";
     ss_output << "\tNormal Sprites: " << sff.header.NumberOfSprites - sff.numLinkedSprites << "\n";
-    ss_output << "\tLinked Sprites: " << sff.numLinkedSprites << "\n\n";
-    ss_output << "Total Palettes: " << sff.header.NumberOfPalettes << "\n\n";
+    ss_output << "\tLinked Sprites: " << sff.numLinkedSprites << "\n";
+    if (!sff.lazy)
+        ss_output << "\tDuplicate Sprites: " << sff.numDedupSprites << " (" << sff.dedupBytes / 1024 << " KB shared)\n";
+    ss_output << "\n";
+    ss_output << "Total Palettes: " << sff.header.NumberOfPalettes << "\n";
+    ss_output << "\tDuplicate Palettes: " << sff.numDupPalettes << " (merged)\n\n";
+    size_t shared_bytes;
+    size_t file_bytes = sffTextureBytes(sff, &shared_bytes);
+    ss_output << "Texture Memory: " << file_bytes / 1024 << " KB (" << shared_bytes / 1024 << " KB shared with other files)\n\n";
+    const PngBatchStats& png = sff.pngStats;
+    if (png.sprites && png.seconds > 0) {
+        ss_output << "PNG Decode: " << png.sprites << " sprites in " << (int) (png.seconds * 1000) << " ms\n";
+        ss_output << "\t" << (int) (png.bytesIn / (1024.0 * 1024.0) / png.seconds) << " MB/s in, " << (int) (png.pixelsOut / 1e6 / png.seconds) << " Mpx/s out\n\n";
+    }
+    if (sff.lazy) {
+        ss_output << "Texture Cache: " << sff.cache.order.size() << " sprites, " << sff.cache.used / 1024 << " KB";
+        if (sff.cache.budget)
+            ss_output << " of " << sff.cache.budget / 1024 << " KB";
+        ss_output << "\n\n";
+    }
 
     ss_output << "Compression Usage:\n";
     for (const auto& pair : sff.compression_format_usage) {
@@ -748,13 +715,168 @@ std::vector<char> getSpriteStatistics(Sff& sff) {
     return res;
 }
 
+// An open SFF of the session, with the sprite shown when it is selected
+typedef struct {
+    Sff* sff;
+    int64_t spr_idx;
+    FileWatcher* watcher;   // NULL unless --watch
+} SessionFile;
+
+// Loads an SFF with the load options of defaults. file holds its contents when
+// they were read already (openSessionFiles), else the file is mapped.
+bool loadSessionFile(SessionFile& out, const char* filename, const Sff& defaults, bool watch, MappedFile* file) {
+    Sff* sff = new Sff();
+    if (file)
+        sff->file.swap(*file);
+    sff->lazy = defaults.lazy;
+    sff->cache.budget = defaults.cache.budget;
+    sff->numThreads = defaults.numThreads;
+    sff->progressive = defaults.progressive;
+    sff->useIndex = defaults.useIndex;
+    sff->pixelCacheBudget = defaults.pixelCacheBudget;
+    sff->hashPayloads = watch;
+    if (loadMugenSprite(filename, sff) != 0) {
+        fprintf(stderr, "Failed to load Mugen Sprite %s\n", filename);
+        delete sff;
+        return false;
+    }
+    FileWatcher* watcher = NULL;
+    if (watch) {
+        watcher = new FileWatcher();
+        watcher->start(filename);
+    }
+    out = { sff, 0, watcher };
+    return true;
+}
+
+// Loads an SFF and adds it to the session
+bool openSessionFile(std::vector<SessionFile>& session, const char* filename, const Sff& defaults, bool watch) {
+    SessionFile f;
+    if (!loadSessionFile(f, filename, defaults, watch, NULL))
+        return false;
+    session.push_back(f);
+    return true;
+}
+
+// Loads several SFF and adds them to the session in the given order. The files
+// are read with batched reads (io_uring when available, depth reads in flight)
+// while the ones already in are decoded. Lazy loads keep their file for the
+// whole session, so they map it instead. Returns the number of files opened.
+size_t openSessionFiles(std::vector<SessionFile>& session, const std::vector<std::string>& filenames, const Sff& defaults, bool watch, unsigned depth) {
+    size_t numOpened = 0;
+    if (filenames.size() < 2 || defaults.lazy) {
+        for (const std::string& name : filenames)
+            numOpened += openSessionFile(session, name.c_str(), defaults, watch);
+        return numOpened;
+    }
+
+    // Files arrive in any order, a file the reader failed on is mapped again
+    // by loadMugenSprite and reports its own error
+    std::vector<SessionFile> loaded(filenames.size(), SessionFile{ NULL, 0, NULL });
+    std::vector<bool> tried(filenames.size(), false);
+    SffBatchReader reader;
+    reader.start(filenames, depth);
+    MappedFile file;
+    for (int i; (i = reader.next(file)) >= 0;) {
+        tried[i] = true;
+        loadSessionFile(loaded[i], filenames[i].c_str(), defaults, watch, &file);
+    }
+    reader.stop();
+    for (size_t i = 0; i < filenames.size(); i++) {
+        if (!tried[i])
+            loadSessionFile(loaded[i], filenames[i].c_str(), defaults, watch, NULL);
+        if (loaded[i].sff) {
+            session.push_back(loaded[i]);
+            numOpened++;
+        }
+    }
+    return numOpened;
+}
+
+// Texture memory of the whole session, shared textures counted once
+size_t sessionTextureBytes(const std::vector<SessionFile>& session) {
+    size_t total = texturePool().bytes;
+    for (const SessionFile& f : session) {
+        if (f.sff->lazy)
+            total += f.sff->cache.used;
+    }
+    return total;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc <= 1) {
+    std::vector<const char*> sff_filenames;
+    bool opt_lazy = false;          // Decode sprites on demand
+    size_t opt_cache_mb = 256;      // Texture budget in lazy mode, 0 = unlimited
+    unsigned opt_threads = 0;       // Decode workers, 0 = one per CPU core
+    bool opt_progressive = false;   // Show the window at once, stream sprites in
+    bool opt_index = false;         // Reuse parsed headers from the cache directory
+    size_t opt_pixel_cache_mb = 0;  // Disk cache of decoded PNG sprites, 0 = disabled
+    bool opt_watch = false;         // Reload the SFF when it is saved
+    const char* opt_catalog_dir = NULL;     // Write a header catalog of this tree and exit
+    const char* opt_catalog_out = NULL;
+    const char* opt_bench_read_dir = NULL;  // Compare file read paths over this tree and exit
+    unsigned opt_io_depth = 64;     // Reads in flight for batch reads
+    bool opt_bench_decode = false;  // Time the sprite decoders on the given files and exit
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--lazy") == 0) {
+            opt_lazy = true;
+        } else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+            opt_cache_mb = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--progressive") == 0) {
+            opt_progressive = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            opt_threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--index") == 0) {
+            opt_index = true;
+        } else if (strcmp(argv[i], "--pixel-cache-mb") == 0 && i + 1 < argc) {
+            opt_pixel_cache_mb = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            opt_watch = true;
+        } else if (strcmp(argv[i], "--catalog") == 0 && i + 2 < argc) {
+            opt_catalog_dir = argv[++i];
+            opt_catalog_out = argv[++i];
+        } else if (strcmp(argv[i], "--bench-read") == 0 && i + 1 < argc) {
+            opt_bench_read_dir = argv[++i];
+        } else if (strcmp(argv[i], "--io-depth") == 0 && i + 1 < argc) {
+            opt_io_depth = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--bench-decode") == 0) {
+            opt_bench_decode = true;
+        } else {
+            sff_filenames.push_back(argv[i]);
+        }
+    }
+
+    // Headless: no window is opened
+    if (opt_catalog_dir) {
+        return buildSffCatalog(opt_catalog_dir, opt_catalog_out, opt_threads) == 0 ? 0 : -1;
+    }
+    if (opt_bench_read_dir) {
+        return benchmarkBatchRead(opt_bench_read_dir, opt_io_depth) == 0 ? 0 : -1;
+    }
+    if (opt_bench_decode && !sff_filenames.empty()) {
+        return benchmarkDecoders(sff_filenames) == 0 ? 0 : -1;
+    }
+
+    if (sff_filenames.empty()) {
 #ifdef _WIN32
         RegisterSFFHandler();
-        MessageBox(NULL, "Usage:\n\t1. MugenSpriteViewer.exe [filename]\n\t2. Just double click SFF file in Windows Explorer", "Mugen Sprite Viewer", MB_OK);
+        MessageBox(NULL, "Usage:\n\t1. MugenSpriteViewer.exe [--lazy|--progressive] [--cache-mb N] [--threads N] [--index] [--pixel-cache-mb N] [--watch] [filename...]\n\t   MugenSpriteViewer.exe [--threads N] --catalog DIR OUT\n\t   MugenSpriteViewer.exe [--io-depth N] --bench-read DIR\n\t   MugenSpriteViewer.exe --bench-decode filename...\n\t2. Just double click SFF file in Windows Explorer", "Mugen Sprite Viewer", MB_OK);
 #else
-        printf("MugenSpriteViewer\nUsage: %s [filename]\n", argv[0]);
+        printf("MugenSpriteViewer\nUsage: %s [--lazy|--progressive] [--cache-mb N] [--threads N] [--index] [--pixel-cache-mb N] [--watch] [filename...]\n", argv[0]);
+        printf("       %s [--threads N] --catalog DIR OUT\n", argv[0]);
+        printf("       %s [--io-depth N] --bench-read DIR\n", argv[0]);
+        printf("       %s --bench-decode filename...\n", argv[0]);
+        printf("\t--lazy\t\tdecode sprites on demand instead of at startup\n");
+        printf("\t--progressive\topen the window at once and load sprites in background\n");
+        printf("\t--cache-mb N\ttexture memory kept by --lazy (default 256, 0 = unlimited)\n");
+        printf("\t--threads N\tsprite decode threads (default 0 = one per CPU core)\n");
+        printf("\t--index\t\tkeep a header index of opened files to reopen them faster\n");
+        printf("\t--pixel-cache-mb N\tkeep up to N MB of decoded PNG sprites on disk (default 0 = off)\n");
+        printf("\t--watch\t\treload changed sprites when the file is saved\n");
+        printf("\t--catalog DIR OUT\twrite the sprite headers of every SFF below DIR to OUT, only changed files are parsed again\n");
+        printf("\t--bench-read DIR\tread and parse every SFF below DIR with stdio, mmap and batched reads (io_uring), print files/s\n");
+        printf("\t--io-depth N\treads in flight when several files are opened at once and for --bench-read (default 64)\n");
+        printf("\t--bench-decode\tdecode the sprites of the files with every decoder (RLE8 SSE2/AVX2, RLE5 table...), print MB/s\n");
 #endif   
         return -1;
     }
@@ -831,7 +953,8 @@ int main(int argc, char* argv[]) {
     g_windowSizeLocation = glGetUniformLocation(g_shaderProgram, "uWindowSize");
 
     // Sprite Global Variable
-    Sff sff;
+    std::vector<SessionFile> session;   // Open SFF files
+    size_t cur_file = 0, next_file = 0; // File shown, file to show from next frame
     static int64_t spr_idx = 0;   // Sprite index to be displayed
     static float spr_zoom = 1.0f;
     static bool spr_auto_animate = false; // Auto animate sprite
@@ -841,9 +964,16 @@ int main(int argc, char* argv[]) {
     bool useOptPalette = false; // Use optional palette instead of internal palette
     size_t modal_return_status = 0;
 
-    // Generating Sprite's Texture and Palette's Texture from SFF file
-    if (loadMugenSprite(argv[1], &sff) != 0) {
-        fprintf(stderr, "Failed to load Mugen Sprite %s\n", argv[1]);
+    // Generating Sprite's Texture and Palette's Texture from SFF files
+    Sff defaults;
+    defaults.lazy = opt_lazy;
+    defaults.cache.budget = opt_cache_mb * 1024 * 1024;
+    defaults.numThreads = opt_threads;
+    defaults.progressive = opt_progressive;
+    defaults.useIndex = opt_index;
+    defaults.pixelCacheBudget = opt_pixel_cache_mb * 1024 * 1024;
+    openSessionFiles(session, std::vector<std::string>(sff_filenames.begin(), sff_filenames.end()), defaults, opt_watch, opt_io_depth);
+    if (session.empty()) {
         return -1;
     }
 
@@ -872,8 +1002,18 @@ int main(int argc, char* argv[]) {
 
     // Main loop
     bool done = false;
+    bool loading = false;
     while (!done) {
+        // Switch file, each one keeps its own sprite index
+        if (next_file != cur_file) {
+            session[cur_file].spr_idx = spr_idx;
+            cur_file = next_file;
+            spr_idx = session[cur_file].spr_idx;
+        }
+        Sff& sff = *session[cur_file].sff;
+
         SDL_Event event;
+        std::vector<std::string> dropped;
         while (SDL_PollEvent(&event)) {
             ImGui_ImplSDL2_ProcessEvent(&event);
             if (event.type == SDL_QUIT)
@@ -905,10 +1045,34 @@ int main(int argc, char* argv[]) {
                 case SDLK_SPACE:
                     spr_auto_animate = !spr_auto_animate;
                     break;
+                case SDLK_TAB:
+                    next_file = (cur_file + 1) % session.size();
+                    break;
                 default:
                     break;
                 }
             }
+
+            // Dropped files are added to the session and the last one is shown
+            if (event.type == SDL_DROPFILE) {
+                dropped.push_back(event.drop.file);
+                SDL_free(event.drop.file);
+            }
+        }
+        if (!dropped.empty() && openSessionFiles(session, dropped, defaults, opt_watch, opt_io_depth))
+            next_file = session.size() - 1;
+
+        // Progressive load: take the sprites decoded since last frame
+        for (SessionFile& f : session) {
+            if (f.sff->loader)
+                uploadLoadedSprites(*f.sff, UPLOAD_BUDGET_MS / session.size());
+        }
+        loading = sff.loader != nullptr;
+
+        // Hot reload: only the sprites that changed are decoded again, spr_idx and zoom are kept
+        for (SessionFile& f : session) {
+            if (f.watcher && !f.sff->loader && f.watcher->changed())
+                reloadMugenSprite(f.sff);
         }
 
         if (spr_auto_animate) {
@@ -926,20 +1090,44 @@ int main(int argc, char* argv[]) {
         ImGui::NewFrame();
 
         ImGui::Begin("Mugen Sprite Information");
+        if (session.size() > 1) {
+            if (ImGui::BeginCombo("File", getFilename(sff.filename))) {
+                for (size_t i = 0; i < session.size(); i++) {
+                    const bool isSelected = (cur_file == i);
+                    if (ImGui::Selectable(getFilename(session[i].sff->filename), isSelected))
+                        next_file = i;
+                    if (isSelected)
+                        ImGui::SetItemDefaultFocus();
+                }
+                ImGui::EndCombo();
+            }
+        }
         ImGui::Text("Filename: %s", getFilename(sff.filename));
         ImGui::Text("Version: %d.%d.%d.%d", sff.header.Ver0, sff.header.Ver1, sff.header.Ver2, sff.header.Ver3);
         ImGui::Text("Total Sprites: %u", sff.header.NumberOfSprites);
         ImGui::Text("Total Palettes: %u", sff.header.NumberOfPalettes);
+        size_t shared_bytes;
+        size_t file_bytes = sffTextureBytes(sff, &shared_bytes);
+        ImGui::Text("Texture Memory: %zu KB (%zu KB shared)", file_bytes / 1024, shared_bytes / 1024);
+        if (session.size() > 1)
+            ImGui::Text("Session Memory: %zu KB in %zu files", sessionTextureBytes(session) / 1024, session.size());
+        if (loading) {
+            char progress[64];
+            size_t total = sff.header.NumberOfSprites - sff.numLinkedSprites;
+            snprintf(progress, sizeof(progress), "Loading %zu/%zu", sff.numLoaded, total);
+            ImGui::ProgressBar(total ? (float) sff.numLoaded / total : 1.0f, ImVec2(-FLT_MIN, 0), progress);
+        }
         if (ImGui::BeginPopupContextWindow()) {
-            if (ImGui::MenuItem(modalName[1])) {
+            // Exports read sprites back from the GPU, wait until all are uploaded
+            if (ImGui::MenuItem(modalName[1], NULL, false, !loading)) {
                 modal_return_status = exportAllSpriteAsPNG(sff);
                 showModal = 1;
             }
-            if (ImGui::MenuItem(modalName[2])) {
+            if (ImGui::MenuItem(modalName[2], NULL, false, !loading)) {
                 modal_return_status = exportCurrentSpriteAsPNG(sff, spr_idx);
                 showModal = 2;
             }
-            if (ImGui::MenuItem(modalName[3])) {
+            if (ImGui::MenuItem(modalName[3], NULL, false, !loading)) {
                 modal_return_status = exportAllSpriteAsAtlas(sff);
                 showModal = 3;
             }
@@ -1035,6 +1223,7 @@ int main(int argc, char* argv[]) {
         if (spr_idx < 0)
             spr_idx = 0;
         Sprite& s = sff.sprites[spr_idx];
+        getSpriteTexture(sff, spr_idx);
 
         ImGui::Begin("Active Sprite");
 #ifdef __MINGW64__
@@ -1045,12 +1234,16 @@ int main(int argc, char* argv[]) {
 
         ImGui::Text("Group: %d,%d", s.Group, s.Number);
         ImGui::Text("Size: %dx%d", s.Size[0], s.Size[1]);
+        if (s.hasBounds)
+            ImGui::Text("Bounds: %d,%d %dx%d", s.Bounds[0], s.Bounds[1], s.Bounds[2], s.Bounds[3]);
         // ImGui::Text("Compression: %s", sff.header.Ver0 == 2 ? compression_code[-s.rle].c_str() : "PCX");
         ImGui::Text("Compression: %s", compression_format_code[s.rle].c_str());
         if (sff.header.Ver0 == 2) {
             ImGui::Text("Color depth: %d", s.coldepth);
         }
         ImGui::Text("Palette No: %d", s.palidx);
+        if (loading && s.texture_id == 0)
+            ImGui::Text("Loading...");
         if (opt_palettes.size())
             ImGui::Checkbox("Use Additional Palette", &useOptPalette);
         // ImGui::Text("Rendering %.1f fps", io.Framerate);
@@ -1081,6 +1274,7 @@ int main(int argc, char* argv[]) {
         ImGui::Text("Press SPACE to start/stop auto animation");
         ImGui::Text("Press HOME to go to first sprite");
         ImGui::Text("Press END to go to last sprite");
+        ImGui::Text("Press TAB to switch file, drop SFF files to open more");
         ImGui::Text("Press ESC or Q to quit");
         ImGui::End();
 
@@ -1173,7 +1367,11 @@ int main(int argc, char* argv[]) {
     glDeleteProgram(g_RGBAShaderProgram);
     glDeleteProgram(g_PalettedShaderProgram);
 
-    deleteMugenSprite(sff);
+    for (SessionFile& f : session) {
+        deleteMugenSprite(*f.sff);
+        delete f.sff;
+        delete f.watcher;
+    }
 
     SDL_GL_DeleteContext(gl_context);
     SDL_DestroyWindow(window);
@@ -1,5 +1,10 @@
 #include "mugen_sff.h"
 
+// Pool keys of palette textures, sprites use their pixel layout as seed
+#define PALETTE_RGB_SEED 0x52474250414cULL
+#define PALETTE_RGBA_SEED 0x52474241504cULL
+#define PALETTE_LAYOUT ((256ULL << 32) | (1 << 16) | 1)	// 256x1 RGBA
+
 // Palette Texture as GL_UNSIGNED_BYTE
 GLuint generateTextureFromPaletteRGBA(uint32_t pal_rgba[256]) {
 	GLuint tex;
@@ -88,6 +93,83 @@ GLuint generateTextureFromPaletteACT(const char* actFilename) {
 	return tex;
 }
 
+// Textures shared by every open Sff, keyed by content hash
+static TexturePool g_texturePool;
+
+const TexturePool& texturePool() {
+	return g_texturePool;
+}
+
+// Takes a reference on the pooled texture with this key, 0 if there is none
+// or it has another layout (the hashes collided)
+GLuint acquirePooledTexture(uint64_t key, uint64_t layout) {
+	auto it = g_texturePool.byKey.find(key);
+	if (it == g_texturePool.byKey.end() || it->second.layout != layout) {
+		return 0;
+	}
+	it->second.refs++;
+	return it->second.texture_id;
+}
+
+// Puts a new texture in the pool, the caller holds its first reference. On a
+// key taken by another layout the texture stays out of the pool and
+// releaseTexture deletes it.
+void addPooledTexture(uint64_t key, uint64_t layout, GLuint texture_id, size_t bytes) {
+	if (!g_texturePool.byKey.emplace(key, PooledTexture{ texture_id, bytes, 1, layout }).second) {
+		return;
+	}
+	g_texturePool.keyOf[texture_id] = key;
+	g_texturePool.bytes += bytes;
+}
+
+// Drops one reference, the texture is deleted with the last one. Textures
+// that are not pooled are deleted at once.
+void releaseTexture(GLuint texture_id) {
+	if (!texture_id) {
+		return;
+	}
+	auto k = g_texturePool.keyOf.find(texture_id);
+	if (k == g_texturePool.keyOf.end()) {
+		glDeleteTextures(1, &texture_id);
+		return;
+	}
+	auto it = g_texturePool.byKey.find(k->second);
+	if (--it->second.refs > 0) {
+		return;
+	}
+	g_texturePool.bytes -= it->second.bytes;
+	g_texturePool.byKey.erase(it);
+	g_texturePool.keyOf.erase(k);
+	glDeleteTextures(1, &texture_id);
+}
+
+// Number of references on a pooled texture, 0 if it is not pooled
+int pooledTextureRefs(GLuint texture_id) {
+	auto k = g_texturePool.keyOf.find(texture_id);
+	return k == g_texturePool.keyOf.end() ? 0 : g_texturePool.byKey[k->second].refs;
+}
+
+// Palette texture for the colors at pal (v1: 256 RGB, v2: 256 RGBA), shared
+// with the other open files
+GLuint sharedPaletteTexture(const uint8_t* pal, bool rgb) {
+	uint64_t key = hashBytes(pal, rgb ? 768 : 1024, rgb ? PALETTE_RGB_SEED : PALETTE_RGBA_SEED);
+	GLuint tex = acquirePooledTexture(key, PALETTE_LAYOUT);
+	if (tex) {
+		return tex;
+	}
+	if (rgb) {
+		rgb_t pal_rgb[256];
+		memcpy(pal_rgb, pal, sizeof(pal_rgb));
+		tex = generateTextureFromPaletteRGB(pal_rgb);
+	} else {
+		uint32_t pal_rgba[256];
+		memcpy(pal_rgba, pal, sizeof(pal_rgba));
+		tex = generateTextureFromPaletteRGBA(pal_rgba);
+	}
+	addPooledTexture(key, PALETTE_LAYOUT, tex, 256 * 4);
+	return tex;
+}
+
 GLuint generateTextureFromSprite(GLuint spr_w, GLuint spr_h, uint8_t* spr_px) {
 	unsigned int tex;
 
@@ -221,118 +303,68 @@ int readSffHeader(Sff* sff, FILE* file, uint32_t* lofs, uint32_t* tofs) {
 }
 
 int readSpriteHeaderV1(Sprite& sprite, FILE* file, uint32_t* ofs, uint32_t* size, uint16_t* link) {
-	// Read ofs
-	if (fread(ofs, sizeof(uint32_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading ofs\n");
-		return -1;
-	}
-	// Read size
-	if (fread(size, sizeof(uint32_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading size\n");
-		return -1;
-	}
-	if (fread(&sprite.Offset[0], sizeof(int16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite offset\n");
-		return -1;
-	}
-	if (fread(&sprite.Offset[1], sizeof(int16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite offset\n");
-		return -1;
-	}
-	// Read sprite header
-	if (fread(&sprite.Group, sizeof(int16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite group\n");
-		return -1;
-	}
-	if (fread(&sprite.Number, sizeof(int16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite number\n");
-		return -1;
-	}
-	// Read the link to the next sprite header
-	if (fread(link, sizeof(uint16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite link\n");
+	// Whole subheader in one read, the caller positions the file and reads ps itself
+	SpriteHeaderV1 h;
+	if (fread(&h, offsetof(SpriteHeaderV1, SamePalette), 1, file) != 1) {
+		fprintf(stderr, "Error reading sprite v1 header\n");
 		return -1;
 	}
+	*ofs = h.NextSubheader;
+	*size = h.Size;
+	sprite.Offset[0] = h.Offset[0];
+	sprite.Offset[1] = h.Offset[1];
+	sprite.Group = h.Group;
+	sprite.Number = h.Number;
+	*link = h.Link;
 	// Print sprite header information
 	// printf("Sprite v1 Group, Number: %d,%d size=%u Offset=%u,%u\n", sprite.Group, sprite.Number, *size, sprite.Offset[0], sprite.Offset[1]);
 	return 0;
 }
 
-int readSpriteHeaderV2(Sprite& sprite, FILE* file, uint32_t* ofs, uint32_t* size, uint32_t lofs, uint32_t tofs, uint16_t* link) {
-	// Read sprite header
-	if (fread(&sprite.Group, sizeof(int16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite group\n");
-		return -1;
-	}
-	if (fread(&sprite.Number, sizeof(int16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite number\n");
-		return -1;
-	}
-	if (fread(&sprite.Size[0], sizeof(int16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite size\n");
-		return -1;
-	}
-	if (fread(&sprite.Size[1], sizeof(int16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite size\n");
-		return -1;
-	}
-	if (fread(&sprite.Offset[0], sizeof(int16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite offset\n");
-		return -1;
-	}
-	if (fread(&sprite.Offset[1], sizeof(int16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite offset\n");
-		return -1;
-	}
-	// Read the link to the next sprite header
-	if (fread(link, sizeof(uint16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite link\n");
-		return -1;
-	}
-	char format;
-	if (fread(&format, sizeof(char), 1, file) != 1) {
-		fprintf(stderr, "Error reading sprite format\n");
-		return -1;
-	}
-	sprite.rle = -format;
-	// Read color depth
-	if (fread(&sprite.coldepth, sizeof(uint8_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading color depth\n");
-		return -1;
-	}
-	// Read ofs
-	if (fread(ofs, sizeof(uint32_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading ofs\n");
-		return -1;
-	}
-	// Read size
-	if (fread(size, sizeof(uint32_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading size\n");
-		return -1;
-	}
-	uint16_t tmp;
-	// Read tmp
-	if (fread(&tmp, sizeof(uint16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading tmp\n");
-		return -1;
+static inline void decodeSpriteHeaderV2(Sprite& sprite, const SpriteHeaderV2& h, uint32_t lofs, uint32_t tofs) {
+	sprite.Group = h.Group;
+	sprite.Number = h.Number;
+	sprite.Size[0] = h.Size[0];
+	sprite.Size[1] = h.Size[1];
+	sprite.Offset[0] = h.Offset[0];
+	sprite.Offset[1] = h.Offset[1];
+	sprite.rle = -(int) (char) h.Format;
+	sprite.coldepth = h.ColorDepth;
+	sprite.palidx = h.PaletteIndex;
+	sprite.data_ofs = h.DataOffset + ((h.Flags & 1) == 0 ? lofs : tofs);
+	sprite.data_len = h.DataSize;
+}
+
+// Decodes a whole v2 sprite header table in one pass. links receives the raw
+// link field of each header (meaningful when DataSize is 0).
+void decodeSpriteHeadersV2(const SpriteHeaderV2* table, uint32_t count, uint32_t lofs, uint32_t tofs, Sprite* sprites, uint16_t* links) {
+	for (uint32_t i = 0; i < count; i++) {
+		decodeSpriteHeaderV2(sprites[i], table[i], lofs, tofs);
+		links[i] = table[i].Link;
 	}
-	sprite.palidx = tmp;
-	// Read tmp
-	if (fread(&tmp, sizeof(uint16_t), 1, file) != 1) {
-		fprintf(stderr, "Error reading tmp\n");
+}
+
+int readSpriteHeaderV2(Sprite& sprite, FILE* file, uint32_t* ofs, uint32_t* size, uint32_t lofs, uint32_t tofs, uint16_t* link) {
+	SpriteHeaderV2 h;
+	if (fread(&h, sizeof(h), 1, file) != 1) {
+		fprintf(stderr, "Error reading sprite v2 header\n");
 		return -1;
 	}
-	if ((tmp & 1) == 0) {
-		*ofs += lofs;
-	} else {
-		*ofs += tofs;
-	}
-
+	decodeSpriteHeaderV2(sprite, h, lofs, tofs);
+	*ofs = sprite.data_ofs;
+	*size = sprite.data_len;
+	*link = h.Link;
 	return 0;
 }
 
-uint32_t readSffHeader(Sff* sff, uint8_t* data, uint32_t* lofs, uint32_t* tofs) {
+// Header of the SFF in data (size bytes). Returns the bytes read, 0 if the
+// header is invalid or does not fit in size.
+uint32_t readSffHeader(Sff* sff, const uint8_t* data, size_t size, uint32_t* lofs, uint32_t* tofs) {
 	uint32_t offset = 0;
+	if (size < 28) {
+		fprintf(stderr, "SFF header truncated\n");
+		return 0;
+	}
 
 	// Validate header by comparing the first 12 bytes with "ElecbyteSpr\x0"
 	char headerCheck[12];
@@ -354,6 +386,10 @@ uint32_t readSffHeader(Sff* sff, uint8_t* data, uint32_t* lofs, uint32_t* tofs)
 	offset += sizeof(uint32_t);
 
 	if (sff->header.Ver0 == 2) {
+		if (size < 64) {
+			fprintf(stderr, "SFF v2 header truncated\n");
+			return 0;
+		}
 		for (int i = 0; i < 4; i++) {
 			memcpy(&dummy, data + offset, sizeof(uint32_t));
 			offset += sizeof(uint32_t);
@@ -406,6 +442,51 @@ uint32_t readSffHeader(Sff* sff, uint8_t* data, uint32_t* lofs, uint32_t* tofs)
 	return offset;
 }
 
+// Window of the SFF v1 subheader chain read ahead of the header walker
+#define V1_READAHEAD (4 * 1024 * 1024)
+
+// Little-endian field access into a mapped file (fields are not aligned)
+static inline uint16_t readU16(const uint8_t* p) {
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t readU32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+int readSpriteHeaderV1(Sprite& sprite, const uint8_t* data, size_t filesize, uint64_t shofs, uint32_t* ofs, uint32_t* size, uint16_t* link) {
+	if (shofs + sizeof(SpriteHeaderV1) > filesize) {
+		fprintf(stderr, "Error reading sprite v1 header at %llu\n", (unsigned long long) shofs);
+		return -1;
+	}
+	const SpriteHeaderV1* h = (const SpriteHeaderV1*) (data + shofs);
+	*ofs = h->NextSubheader;
+	*size = h->Size;
+	sprite.Offset[0] = h->Offset[0];
+	sprite.Offset[1] = h->Offset[1];
+	sprite.Group = h->Group;
+	sprite.Number = h->Number;
+	*link = h->Link;
+	return 0;
+}
+
+int readSpriteHeaderV2(Sprite& sprite, const uint8_t* data, size_t filesize, uint64_t shofs, uint32_t* ofs, uint32_t* size, uint32_t lofs, uint32_t tofs, uint16_t* link) {
+	if (shofs + sizeof(SpriteHeaderV2) > filesize) {
+		fprintf(stderr, "Error reading sprite v2 header at %llu\n", (unsigned long long) shofs);
+		return -1;
+	}
+	const SpriteHeaderV2* h = (const SpriteHeaderV2*) (data + shofs);
+	decodeSpriteHeaderV2(sprite, *h, lofs, tofs);
+	*ofs = sprite.data_ofs;
+	*size = sprite.data_len;
+	*link = h->Link;
+	return 0;
+}
+
 void spriteCopy(Sprite& dst, const Sprite& src) {
 	dst.Group = src.Group;
 	dst.Number = src.Number;
@@ -419,121 +500,160 @@ void spriteCopy(Sprite& dst, const Sprite& src) {
 	dst.texture_id = src.texture_id;
 }
 
-uint8_t* RlePcxDecode(Sprite& s, uint8_t* srcPx, size_t srcLen) {
-	if (srcLen == 0) {
-		fprintf(stderr, "Warning: PCX data length is zero\n");
-		return NULL;
+// Grows buf to hold len bytes, the content is not kept
+bool reservePixels(PixelBuffer& buf, size_t len) {
+	if (len <= buf.cap && buf.data) {
+		return true;
+	}
+	free(buf.data);
+	buf.data = (uint8_t*) malloc(len ? len : 1);
+	buf.cap = buf.data ? len : 0;
+	if (!buf.data) {
+		fprintf(stderr, "Error allocating memory for sprite data (%zu bytes)\n", len);
+		return false;
 	}
+	return true;
+}
 
-	size_t dstLen = s.Size[0] * s.Size[1];
-	uint8_t* dstPx = (uint8_t*) malloc(dstLen);
-	if (!dstPx) {
-		fprintf(stderr, "Error allocating memory for PCX decoded data dstLen=%zu srcLen=%zu (%dx%d)\n", dstLen, srcLen, s.Size[0], s.Size[1]);
-		return NULL;
+// Buffers of the calling thread, reused by every sprite it reads or decodes
+typedef struct ThreadScratch {
+	PixelBuffer src = { NULL, 0 };	// compressed data read from a FILE* or joined from PNG chunks
+	PixelBuffer px = { NULL, 0 };	// pixels uploaded as soon as decoded
+	~ThreadScratch() {
+		free(src.data);
+		free(px.data);
+	}
+} ThreadScratch;
+
+static ThreadScratch& threadScratch() {
+	static thread_local ThreadScratch scratch;
+	return scratch;
+}
+
+// Checks the caller's span holds the len bytes a decoder is about to write
+static bool spanFits(PixelSpan dst, size_t len, const char* format) {
+	if (!dst.data || dst.len < len) {
+		fprintf(stderr, "Error: %s output buffer too small (%zu < %zu)\n", format, dst.len, len);
+		return false;
 	}
+	return true;
+}
 
-	size_t i = 0; // input pointer
-	size_t j = 0; // output pointer
+// PCX scanlines are bpl bytes long (width rounded up to even by most
+// encoders). The RLE stream is decoded as one run of rows, runs may cross a
+// row end, and only the first Size[0] bytes of each row are stored.
+int RlePcxDecode(Sprite& s, const uint8_t* srcPx, size_t srcLen, uint16_t bpl, PixelSpan dst) {
+	if (srcLen == 0) {
+		fprintf(stderr, "Warning: PCX data length is zero\n");
+		return -1;
+	}
 
-	while (i < srcLen && j < dstLen) {
-		uint8_t byte = srcPx[i++];
-		int count = 1;
+	size_t width = s.Size[0];
+	size_t dstLen = width * s.Size[1];
+	if (!spanFits(dst, dstLen, "PCX")) {
+		return -1;
+	}
+	uint8_t* dstPx = dst.data;
+	size_t rowLen = bpl >= width ? bpl : width;	// a short bpl is broken, read rows unpadded
 
+	size_t i = 0;		// input pointer
+	size_t col = 0;		// position in the current scanline
+	uint8_t* row = dstPx;
+	uint8_t* end = dstPx + dstLen;
+	while (i < srcLen && row < end) {
+		uint8_t byte = srcPx[i];
 		if ((byte & 0xC0) == 0xC0) { // RLE marker
-			count = byte & 0x3F;
-			if (i < srcLen) {
-				byte = srcPx[i++];
-			} else {
+			if (i + 1 >= srcLen) {
 				fprintf(stderr, "Warning: RLE marker at end of data\n");
 				break;
 			}
-		}
-
-		while (count-- > 0 && j < dstLen) {
-			dstPx[j++] = byte;
+			size_t count = byte & 0x3F;
+			byte = srcPx[i + 1];
+			i += 2;
+			while (count > 0 && row < end) {
+				size_t n = std::min(count, rowLen - col);
+				if (col < width) {
+					memset(row + col, byte, std::min(n, width - col));
+				}
+				col += n;
+				count -= n;
+				if (col == rowLen) {
+					row += width;
+					col = 0;
+				}
+			}
+		} else {
+			// Literal stretch, up to the next marker or the row end
+			size_t n = 1;
+			size_t max = std::min(srcLen - i, rowLen - col);
+			while (n < max && (srcPx[i + n] & 0xC0) != 0xC0) {
+				n++;
+			}
+			if (col < width) {
+				memcpy(row + col, srcPx + i, std::min(n, width - col));
+			}
+			i += n;
+			col += n;
+			if (col == rowLen) {
+				row += width;
+				col = 0;
+			}
 		}
 	}
 
+	size_t j = row < end ? (row - dstPx) + std::min(col, width) : dstLen;
 	if (j < dstLen) {
 		fprintf(stderr, "Warning: decoded PCX data shorter than expected (%zu vs %zu)\n", j, dstLen);
 		// Fill the remaining bytes with 0 (or a background color)
 		memset(dstPx + j, 0, dstLen - j);
 	}
 
-	return dstPx;
+	return 0;
 }
 
-
-uint8_t* Rle8Decode(Sprite& s, uint8_t* srcPx, size_t srcLen) {
+int Rle8Decode(Sprite& s, const uint8_t* srcPx, size_t srcLen, PixelSpan dst) {
 	if (srcLen == 0) {
 		fprintf(stderr, "Warning RLE8 data length is zero\n");
-		return NULL;
+		return -1;
 	}
 
 	size_t dstLen = s.Size[0] * s.Size[1];
-	uint8_t* dstPx = (uint8_t*) malloc(dstLen);
-	if (!dstPx) {
-		fprintf(stderr, "Error allocating memory for RLE decoded data\n");
-		return NULL;
-	}
-	size_t i = 0, j = 0;
-	// Decode the RLE data
-	while (j < dstLen) {
-		long n = 1;
-		uint8_t d = srcPx[i];
-		if (i < (srcLen - 1)) {
-			i++;
-		}
-		if ((d & 0xc0) == 0x40) {
-			n = d & 0x3f;
-			d = srcPx[i];
-			if (i < (srcLen - 1)) {
-				i++;
-			}
-		}
-		for (; n > 0; n--) {
-			if (j < dstLen) {
-				dstPx[j] = d;
-				j++;
-			}
-		}
+	if (!spanFits(dst, dstLen, "RLE8")) {
+		return -1;
 	}
-	return dstPx;
+	// Fastest kernel of this CPU, picked once
+	static const DecodeKernel kernel = rle8Kernels().back();
+	kernel.decode(srcPx, srcLen, dst.data, dstLen);
+	return 0;
 }
 
-uint8_t* Rle5Decode(Sprite& s, uint8_t* srcPx, size_t srcLen) {
-	if (srcLen == 0) {
-		fprintf(stderr, "Warning RLE5 data length is zero\n");
-		return NULL;
-	}
-
-	size_t dstLen = s.Size[0] * s.Size[1];
-	uint8_t* dstPx = (uint8_t*) malloc(dstLen);
-	if (!dstPx) {
-		fprintf(stderr, "Error allocating memory for RLE decoded data\n");
-		return NULL;
-	}
+// RLE5 packet: a run length byte, then a byte holding the number of codes
+// that follow in its low 7 bits and in bit 7 whether a color byte comes next
+// (color 0 otherwise). That color is written run length + 1 times, then each
+// code gives a color (low 5 bits) and run length - 1 (high 3 bits).
 
-	size_t i = 0, j = 0;
+// Decodes from src[i] / dst[j] on, byte at a time. At the end of the input the
+// last byte is read again and again, as the decoder always did.
+static void rle5DecodeFrom(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen, size_t i, size_t j) {
 	while (j < dstLen) {
-		int rl = (int) srcPx[i];
+		int rl = (int) src[i];
 		if (i < srcLen - 1) {
 			i++;
 		}
-		int dl = (int) (srcPx[i] & 0x7f);
+		int dl = (int) (src[i] & 0x7f);
 		uint8_t c = 0;
-		if (srcPx[i] >> 7 != 0) {
+		if (src[i] >> 7 != 0) {
 			if (i < srcLen - 1) {
 				i++;
 			}
-			c = srcPx[i];
+			c = src[i];
 		}
 		if (i < srcLen - 1) {
 			i++;
 		}
 		while (1) {
 			if (j < dstLen) {
-				dstPx[j] = c;
+				dst[j] = c;
 				j++;
 			}
 			rl--;
@@ -542,72 +662,141 @@ uint8_t* Rle5Decode(Sprite& s, uint8_t* srcPx, size_t srcLen) {
 				if (dl < 0) {
 					break;
 				}
-				c = srcPx[i] & 0x1f;
-				rl = (int) (srcPx[i] >> 5);
+				c = src[i] & 0x1f;
+				rl = (int) (src[i] >> 5);
 				if (i < srcLen - 1) {
 					i++;
 				}
 			}
 		}
 	}
+}
+
+void rle5DecodeReference(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen) {
+	rle5DecodeFrom(src, srcLen, dst, dstLen, 0, 0);
+}
+
+typedef struct {
+	uint8_t color;
+	uint8_t count;
+} Rle5Code;
+
+static constexpr std::array<Rle5Code, 256> rle5Codes() {
+	std::array<Rle5Code, 256> codes = {};
+	for (int b = 0; b < 256; b++) {
+		codes[b] = { (uint8_t) (b & 0x1f), (uint8_t) ((b >> 5) + 1) };
+	}
+	return codes;
+}
+
+static constexpr std::array<Rle5Code, 256> RLE5_CODES = rle5Codes();
 
-	return dstPx;
+#define RLE5_MAX_PACKET 130	// run length, code count, color, 127 codes
+
+// Packets lying wholly inside the input are decoded without bounds checks on
+// the input. Codes are written as 8 bytes when there is room (a code is at
+// most 8 pixels, the rest is overwritten next). Near the end of the input the
+// byte loop takes over, so that its re-read of the last byte stays identical.
+void rle5DecodeTable(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen) {
+	size_t i = 0, j = 0;
+	while (i + RLE5_MAX_PACKET < srcLen && j < dstLen) {
+		size_t n = (size_t) src[i] + 1;
+		uint8_t flags = src[i + 1];
+		uint8_t c = 0;
+		i += 2;
+		if (flags & 0x80) {
+			c = src[i++];
+		}
+		n = std::min(n, dstLen - j);
+		memset(dst + j, c, n);
+		j += n;
+
+		const uint8_t* code = src + i;
+		size_t count = flags & 0x7f;
+		i += count;
+		for (size_t k = 0; k < count; k++) {
+			Rle5Code r = RLE5_CODES[code[k]];
+			if (j + 8 <= dstLen) {
+				uint64_t v = r.color * 0x0101010101010101ull;
+				memcpy(dst + j, &v, 8);
+				j += r.count;
+			} else {
+				size_t m = std::min((size_t) r.count, dstLen - j);
+				memset(dst + j, r.color, m);
+				j += m;
+			}
+		}
+	}
+	if (j < dstLen) {
+		rle5DecodeFrom(src, srcLen, dst, dstLen, i, j);
+	}
 }
 
-uint8_t* Lz5Decode(Sprite& s, uint8_t* srcPx, size_t srcLen) {
+int Rle5Decode(Sprite& s, const uint8_t* srcPx, size_t srcLen, PixelSpan dst) {
 	if (srcLen == 0) {
-		fprintf(stderr, "Warning LZ5 data length is zero\n");
-		return NULL;
+		fprintf(stderr, "Warning RLE5 data length is zero\n");
+		return -1;
 	}
 
 	size_t dstLen = s.Size[0] * s.Size[1];
-	uint8_t* dstPx = (uint8_t*) malloc(dstLen);
-	if (!dstPx) {
-		fprintf(stderr, "Error allocating memory for LZ5 decoded data\n");
-		return NULL;
+	if (!spanFits(dst, dstLen, "RLE5")) {
+		return -1;
 	}
+	rle5DecodeTable(srcPx, srcLen, dst.data, dstLen);
+	return 0;
+}
 
-	// Decode the LZ5 data
-	size_t i = 0, j = 0;
-	long n = 0;
-	uint8_t ct = srcPx[i], cts = 0, rb = 0, rbc = 0;
-	if (i < srcLen - 1) {
-		i++;
-	}
+// LZ5: a control byte gives, bit by bit, the kind of the next 8 tokens:
+// back-references (distance and length, short distances borrow their top 2
+// bits from a shared byte) or runs of a 5 bit color. Back-references pointing
+// before the start of the sprite read as 0.
+
+typedef struct {
+	size_t i, j;
+	uint8_t ct, cts, rb, rbc;
+} Lz5State;
 
+#define LZ5_MAX_TOKEN 263	// longest output of one token (run of 255 + 8)
+
+// Decodes from st on, byte at a time. At the end of the input the last byte
+// is read again and again, as the decoder always did.
+static void lz5DecodeFrom(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen, Lz5State st) {
+	size_t i = st.i, j = st.j;
+	uint8_t ct = st.ct, cts = st.cts, rb = st.rb, rbc = st.rbc;
+	long n = 0;
 	while (j < dstLen) {
-		int d = (int) srcPx[i];
+		size_t d = src[i];
 		if (i < srcLen - 1) {
 			i++;
 		}
 
 		if (ct & (1 << cts)) {
 			if ((d & 0x3f) == 0) {
-				d = (d << 2 | (int) srcPx[i]) + 1;
+				d = (d << 2 | (size_t) src[i]) + 1;
 				if (i < srcLen - 1) {
 					i++;
 				}
-				n = (int) srcPx[i] + 2;
+				n = (long) src[i] + 2;
 				if (i < srcLen - 1) {
 					i++;
 				}
 			} else {
 				rb |= (uint8_t) ((d & 0xc0) >> rbc);
 				rbc += 2;
-				n = (int) (d & 0x3f);
+				n = (long) (d & 0x3f);
 				if (rbc < 8) {
-					d = (int) srcPx[i] + 1;
+					d = (size_t) src[i] + 1;
 					if (i < srcLen - 1) {
 						i++;
 					}
 				} else {
-					d = (int) rb + 1;
+					d = (size_t) rb + 1;
 					rb = rbc = 0;
 				}
 			}
 			for (;;) {
 				if (j < dstLen) {
-					dstPx[j] = dstPx[j - d];
+					dst[j] = j >= d ? dst[j - d] : 0;
 					j++;
 				}
 				n--;
@@ -617,7 +806,7 @@ uint8_t* Lz5Decode(Sprite& s, uint8_t* srcPx, size_t srcLen) {
 			}
 		} else {
 			if ((d & 0xe0) == 0) {
-				n = (int) srcPx[i] + 8;
+				n = (long) src[i] + 8;
 				if (i < srcLen - 1) {
 					i++;
 				}
@@ -626,31 +815,134 @@ uint8_t* Lz5Decode(Sprite& s, uint8_t* srcPx, size_t srcLen) {
 				d &= 0x1f;
 			}
 			while (n-- > 0 && j < dstLen) {
-				dstPx[j] = (uint8_t) d;
+				dst[j] = (uint8_t) d;
 				j++;
 			}
 		}
 		cts++;
 		if (cts >= 8) {
-			ct = srcPx[i];
+			ct = src[i];
 			cts = 0;
 			if (i < srcLen - 1) {
 				i++;
 			}
 		}
 	}
+}
 
-	return dstPx;
+static Lz5State lz5Start(const uint8_t* src, size_t srcLen) {
+	Lz5State st = {};
+	st.ct = src[0];
+	st.i = srcLen > 1 ? 1 : 0;
+	return st;
 }
 
-uint8_t* PngDecode(Sprite& s, uint8_t* data, uint32_t datasize) {
-	lodepng::State state;
-	unsigned int width = 0, height = 0;
+void lz5DecodeReference(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen) {
+	lz5DecodeFrom(src, srcLen, dst, dstLen, lz5Start(src, srcLen));
+}
+
+// Copies len bytes from d back (d <= bytes already decoded), may write up to
+// 15 bytes past len. Chunks never overlap their source: distances of 8 or
+// more copy 8 or 16 bytes at a time, shorter ones repeat their pattern up to
+// 8 bytes first, then copy from the nearest multiple of d that is 8 or more.
+static inline void lz5CopyMatch(uint8_t* dst, size_t d, size_t len) {
+	const uint8_t* from = dst - d;
+	if (d >= 16) {
+		for (size_t k = 0; k < len; k += 16) {
+			memcpy(dst + k, from + k, 16);
+		}
+	} else if (d >= 8) {
+		for (size_t k = 0; k < len; k += 8) {
+			memcpy(dst + k, from + k, 8);
+		}
+	} else if (d == 1) {
+		memset(dst, from[0], len);
+	} else {
+		for (size_t k = 0; k < 8; k++) {
+			dst[k] = from[k];
+		}
+		size_t period = d;
+		while (period < 8) {
+			period += d;
+		}
+		for (size_t k = 8; k < len; k += 8) {
+			memcpy(dst + k, dst + k - period, 8);
+		}
+	}
+}
+
+// While the longest token fits in both buffers (with room for the copy
+// over-write) tokens are decoded without per byte checks, distances are
+// checked once per token. The byte loop ends the sprite.
+void lz5DecodeFast(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen) {
+	Lz5State st = lz5Start(src, srcLen);
+	size_t i = st.i, j = st.j;
+	uint8_t ct = st.ct, cts = 0, rb = 0, rbc = 0;
+	while (i + 4 < srcLen && j + LZ5_MAX_TOKEN + 16 <= dstLen) {
+		size_t d = src[i++];
+		if (ct & (1 << cts)) {
+			size_t len;
+			if ((d & 0x3f) == 0) {
+				d = ((d << 2) | src[i]) + 1;
+				len = (size_t) src[i + 1] + 3;
+				i += 2;
+			} else {
+				rb |= (uint8_t) ((d & 0xc0) >> rbc);
+				rbc += 2;
+				len = (d & 0x3f) + 1;
+				if (rbc < 8) {
+					d = (size_t) src[i++] + 1;
+				} else {
+					d = (size_t) rb + 1;
+					rb = rbc = 0;
+				}
+			}
+			if (d <= j) {
+				lz5CopyMatch(dst + j, d, len);
+			} else {
+				for (size_t k = j; k < j + len; k++) {
+					dst[k] = k >= d ? dst[k - d] : 0;
+				}
+			}
+			j += len;
+		} else {
+			size_t n;
+			if ((d & 0xe0) == 0) {
+				n = (size_t) src[i++] + 8;
+			} else {
+				n = d >> 5;
+				d &= 0x1f;
+			}
+			memset(dst + j, (uint8_t) d, n);
+			j += n;
+		}
+		if (++cts >= 8) {
+			ct = src[i++];
+			cts = 0;
+		}
+	}
+	lz5DecodeFrom(src, srcLen, dst, dstLen, { i, j, ct, cts, rb, rbc });
+}
+
+int Lz5Decode(Sprite& s, const uint8_t* srcPx, size_t srcLen, PixelSpan dst) {
+	if (srcLen == 0) {
+		fprintf(stderr, "Warning LZ5 data length is zero\n");
+		return -1;
+	}
+
+	size_t dstLen = s.Size[0] * s.Size[1];
+	if (!spanFits(dst, dstLen, "LZ5")) {
+		return -1;
+	}
+	lz5DecodeFast(srcPx, srcLen, dst.data, dstLen);
+	return 0;
+}
 
-	unsigned status = lodepng_inspect(&width, &height, &state, data, datasize);
+// Reads the PNG header and sets up the raw format the sprite is decoded to
+static unsigned pngInspect(const Sprite& s, LodePNGState& state, unsigned* width, unsigned* height, const uint8_t* data, size_t datasize) {
+	unsigned status = lodepng_inspect(width, height, &state, data, datasize);
 	if (status) {
-		fprintf(stderr, "Error inspecting PNG data: %s\n", lodepng_error_text(status));
-		return NULL;
+		return status;
 	}
 
 	if (s.rle == -10)
@@ -662,22 +954,195 @@ uint8_t* PngDecode(Sprite& s, uint8_t* data, uint32_t datasize) {
 		state.info_raw.bitdepth = 16;
 	else
 		state.info_raw.bitdepth = 8;
+	return 0;
+}
 
-	uint8_t* dstPx;
-	status = lodepng_decode(&dstPx, &width, &height, &state, data, datasize);
+// Bytes PngDecode writes, from the PNG header as its size may differ from
+// the sprite header. 0 if the header can not be read.
+size_t pngDecodeBytes(const Sprite& s, const uint8_t* data, size_t datasize) {
+	LodePNGState& state = pngDecodeState();
+	unsigned width = 0, height = 0;
+	unsigned status = pngInspect(s, state, &width, &height, data, datasize);
+	if (status) {
+		fprintf(stderr, "Error inspecting PNG data: %s\n", lodepng_error_text(status));
+		return 0;
+	}
+	return lodepng_get_raw_size(width, height, &state.info_raw);
+}
 
-	if (status != 0) {
-		fprintf(stderr, "Could not decode PNG image(%s)", lodepng_error_text(status));
-		return NULL;
+static inline uint32_t readU32BE(const uint8_t* p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+	int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Reverses the PNG filters of 8-bit single channel scanlines (a filter type
+// byte, then width bytes) into rows of width bytes
+static bool unfilterIndexed(uint8_t* out, const uint8_t* in, size_t width, size_t height) {
+	const uint8_t* prev = NULL;
+	for (size_t y = 0; y < height; y++, in += width + 1, out += width) {
+		const uint8_t* src = in + 1;
+		switch (in[0]) {
+		case 0:
+			memcpy(out, src, width);
+			break;
+		case 1:
+			out[0] = src[0];
+			for (size_t i = 1; i < width; i++) {
+				out[i] = src[i] + out[i - 1];
+			}
+			break;
+		case 2:
+			for (size_t i = 0; i < width; i++) {
+				out[i] = src[i] + (prev ? prev[i] : 0);
+			}
+			break;
+		case 3:
+			out[0] = src[0] + (prev ? prev[0] >> 1 : 0);
+			for (size_t i = 1; i < width; i++) {
+				out[i] = src[i] + ((out[i - 1] + (prev ? prev[i] : 0)) >> 1);
+			}
+			break;
+		case 4:
+			out[0] = src[0] + (prev ? prev[0] : 0);
+			for (size_t i = 1; i < width; i++) {
+				out[i] = src[i] + (prev ? paeth(out[i - 1], prev[i], prev[i - 1]) : out[i - 1]);
+			}
+			break;
+		default:
+			return false;
+		}
+		prev = out;
 	}
-	s.Size[0] = width;
-	s.Size[1] = height;
-	return dstPx;
+	return true;
 }
 
-int readPcxHeader(Sprite& s, FILE* file, uint64_t offset) {
-	fseek(file, offset, SEEK_SET);
-	uint16_t dummy;
+// PNG10 sprites are nearly always 8-bit paletted PNGs whose scanlines hold the
+// very indices the sprite needs. Those are inflated and unfiltered straight
+// into the span, without lodepng's color conversion and output buffer.
+// Returns -1 for other PNGs and on any error, the generic path then decodes
+// (or reports) them.
+static int pngDecodeIndexed(Sprite& s, const uint8_t* data, size_t datasize, PixelSpan dst) {
+	if (datasize < 8 || memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0) {
+		return -1;
+	}
+	size_t width = 0, height = 0;
+	bool palette = false;
+	const uint8_t* idat = NULL;
+	size_t idatLen = 0, numIdat = 0;
+	for (size_t pos = 8;;) {
+		if (datasize - pos < 12) {
+			return -1;
+		}
+		const uint8_t* chunk = data + pos;
+		size_t len = readU32BE(chunk);
+		if (len > datasize - pos - 12 || lodepng_chunk_check_crc(chunk)) {
+			return -1;
+		}
+		const uint8_t* body = chunk + 8;
+		if (pos == 8) {
+			// IHDR first: 8-bit paletted, no interlace
+			if (!lodepng_chunk_type_equals(chunk, "IHDR") || len != 13 || body[8] != 8 || body[9] != 3 || body[10] || body[11] || body[12]) {
+				return -1;
+			}
+			width = readU32BE(body);
+			height = readU32BE(body + 4);
+		} else if (lodepng_chunk_type_equals(chunk, "PLTE")) {
+			palette = true;
+		} else if (lodepng_chunk_type_equals(chunk, "IDAT")) {
+			idat = idat ? idat : body;
+			idatLen += len;
+			numIdat++;
+		} else if (lodepng_chunk_type_equals(chunk, "IEND")) {
+			break;
+		} else if (!lodepng_chunk_ancillary(chunk)) {
+			return -1;	// unknown critical chunk
+		}
+		pos += len + 12;
+	}
+	if (numIdat > 1) {
+		// The zlib stream is split over several chunks, join them
+		PixelBuffer& joined = threadScratch().src;
+		if (!reservePixels(joined, idatLen)) {
+			return -1;
+		}
+		size_t n = 0;
+		for (const uint8_t* chunk = idat - 8; !lodepng_chunk_type_equals(chunk, "IEND"); chunk += readU32BE(chunk) + 12) {
+			if (lodepng_chunk_type_equals(chunk, "IDAT")) {
+				memcpy(joined.data + n, chunk + 8, readU32BE(chunk));
+				n += readU32BE(chunk);
+			}
+		}
+		idat = joined.data;
+	}
+	if (!palette || !idat || width == 0 || height == 0 || width > 0xffff || height > 0xffff || dst.len < width * height) {
+		return -1;
+	}
+
+	size_t expected = height * (width + 1);
+	LodePNGDecompressSettings settings;
+	lodepng_decompress_settings_init(&settings);
+	settings.custom_context = &expected;
+	uint8_t* scanlines = NULL;
+	size_t size = 0;
+	if (sffZlibDecompress(&scanlines, &size, idat, idatLen, &settings) != 0) {
+		return -1;
+	}
+	bool ok = size == expected && unfilterIndexed(dst.data, scanlines, width, height);
+	lodepng_free(scanlines);
+	if (!ok) {
+		return -1;
+	}
+	s.Size[0] = width;
+	s.Size[1] = height;
+	return 0;
+}
+
+// path picks the fast paths used, the benchmarks compare them
+int PngDecode(Sprite& s, const uint8_t* data, size_t datasize, PixelSpan dst, int path) {
+	if (s.rle == -10 && path >= PNG_DIRECT && pngDecodeIndexed(s, data, datasize, dst) == 0) {
+		return 0;
+	}
+
+	LodePNGState& state = pngDecodeState();
+	unsigned int width = 0, height = 0;
+
+	unsigned status = pngInspect(s, state, &width, &height, data, datasize);
+	if (status) {
+		fprintf(stderr, "Error inspecting PNG data: %s\n", lodepng_error_text(status));
+		return -1;
+	}
+	if (!spanFits(dst, lodepng_get_raw_size(width, height, &state.info_raw), "PNG")) {
+		return -1;
+	}
+
+	// Filtered scanlines of a non-interlaced image, the inflate output is
+	// allocated once with that size
+	size_t scanlines = (size_t) height * (1 + ((size_t) width * lodepng_get_bpp(&state.info_png.color) + 7) / 8);
+	state.decoder.zlibsettings.custom_zlib = path >= PNG_INFLATE ? sffZlibDecompress : NULL;
+	state.decoder.zlibsettings.custom_context = &scanlines;
+
+	// lodepng allocates its own output, copied to the span
+	uint8_t* dstPx;
+	status = lodepng_decode(&dstPx, &width, &height, &state, data, datasize);
+
+	if (status != 0) {
+		fprintf(stderr, "Could not decode PNG image(%s)", lodepng_error_text(status));
+		return -1;
+	}
+	memcpy(dst.data, dstPx, lodepng_get_raw_size(width, height, &state.info_raw));
+	lodepng_free(dstPx);
+	s.Size[0] = width;
+	s.Size[1] = height;
+	return 0;
+}
+
+int readPcxHeader(Sprite& s, FILE* file, uint64_t offset, uint16_t* bpl) {
+	fseek(file, offset, SEEK_SET);
+	uint16_t dummy;
 	if (fread(&dummy, sizeof(uint16_t), 1, file) != 1) {
 		fprintf(stderr, "Error reading uint16_t dummy\n");
 		return -1;
@@ -701,8 +1166,7 @@ int readPcxHeader(Sprite& s, FILE* file, uint64_t offset) {
 		return -1;
 	}
 	fseek(file, offset + 66, SEEK_SET);
-	uint16_t bpl;
-	if (fread(&bpl, sizeof(uint16_t), 1, file) != 1) {
+	if (fread(bpl, sizeof(uint16_t), 1, file) != 1) {
 		fprintf(stderr, "Error reading bpl\n");
 		return -1;
 	}
@@ -712,6 +1176,7 @@ int readPcxHeader(Sprite& s, FILE* file, uint64_t offset) {
 	return 0;
 }
 
+// The FILE* readers return a malloc'ed buffer owned by the caller
 uint8_t* readSpriteDataV1(Sprite& s, FILE* file, Sff* sff, uint64_t offset, uint32_t datasize, uint32_t nextSubheader, Sprite* prev, bool c00) {
 	if (nextSubheader > offset) {
 		// Ignore datasize except last
@@ -724,7 +1189,8 @@ uint8_t* readSpriteDataV1(Sprite& s, FILE* file, Sff* sff, uint64_t offset, uint
 		return NULL;
 	}
 	bool paletteSame = ps != 0 && prev != NULL;
-	if (readPcxHeader(s, file, offset) != 0) {
+	uint16_t bpl;
+	if (readPcxHeader(s, file, offset, &bpl) != 0) {
 		fprintf(stderr, "Error reading sprite PCX header\n");
 		return NULL;
 	}
@@ -741,13 +1207,12 @@ uint8_t* readSpriteDataV1(Sprite& s, FILE* file, Sff* sff, uint64_t offset, uint
 		datasize = 128 + palSize;
 	}
 
-	uint8_t* px = NULL;
 	size_t srcLen = datasize - (128 + palSize);
-	uint8_t* srcPx = (uint8_t*) malloc(srcLen);
-	if (!srcPx) {
-		fprintf(stderr, "Error allocating memory for sprite data\n");
+	PixelBuffer& src = threadScratch().src;
+	if (!reservePixels(src, srcLen)) {
 		return NULL;
 	}
+	uint8_t* srcPx = src.data;
 	if (fread(srcPx, srcLen, 1, file) != 1) {
 		fprintf(stderr, "Error reading sprite PCX data pixel\n");
 		return NULL;
@@ -763,7 +1228,6 @@ uint8_t* readSpriteDataV1(Sprite& s, FILE* file, Sff* sff, uint64_t offset, uint
 			fprintf(stderr, "Error: invalid prev palette index %d\n", prev->palidx);
 			return NULL;
 		}
-		px = RlePcxDecode(s, srcPx, srcLen);
 	} else {
 		if (c00) {
 			fseek(file, offset + datasize - 768, 0);
@@ -775,12 +1239,61 @@ uint8_t* readSpriteDataV1(Sprite& s, FILE* file, Sff* sff, uint64_t offset, uint
 		}
 		sff->palettes.emplace_back(generateTextureFromPaletteRGB(pal_rgb));
 		s.palidx = sff->palettes.size() - 1;
-		px = RlePcxDecode(s, srcPx, srcLen);
 	}
-	free(srcPx);
+	size_t dstLen = (size_t) s.Size[0] * s.Size[1];
+	uint8_t* px = (uint8_t*) malloc(dstLen ? dstLen : 1);
+	if (!px) {
+		fprintf(stderr, "Error allocating memory for PCX decoded data\n");
+		return NULL;
+	}
+	if (RlePcxDecode(s, srcPx, srcLen, bpl, { px, dstLen }) != 0) {
+		free(px);
+		return NULL;
+	}
 	return px;
 }
 
+int readPcxHeader(Sprite& s, const uint8_t* data, size_t filesize, uint64_t offset, uint16_t* bpl) {
+	if (offset + 128 > filesize) {
+		fprintf(stderr, "Error reading PCX header\n");
+		return -1;
+	}
+	const uint8_t* p = data + offset;
+	uint8_t bpp = p[3];
+	if (bpp != 8) {
+		fprintf(stderr, "Invalid PCX color depth: expected 8-bit, got %d", bpp);
+		return -1;
+	}
+	uint16_t rect[4];
+	for (int i = 0; i < 4; i++) {
+		rect[i] = readU16(p + 4 + i * 2);
+	}
+	*bpl = readU16(p + 66);
+	s.Size[0] = rect[2] - rect[0] + 1;
+	s.Size[1] = rect[3] - rect[1] + 1;
+	s.rle = -1;	// -1 for PCX
+	return 0;
+}
+
+// Decodes a PCX sprite straight from the mapped file. offset is the PCX header
+// position (subheader + 32), datasize runs up to the next subheader. The
+// palette has already been resolved by readSffHeaders.
+int readSpriteDataV1(Sprite& s, const uint8_t* data, size_t filesize, uint64_t offset, uint32_t datasize, PixelSpan dst) {
+	uint16_t bpl;
+	if (readPcxHeader(s, data, filesize, offset, &bpl) != 0) {
+		fprintf(stderr, "Error reading sprite PCX header\n");
+		return -1;
+	}
+	if (datasize < 128) {
+		datasize = 128;
+	}
+	if (offset + datasize > filesize) {
+		fprintf(stderr, "Error reading sprite PCX data pixel\n");
+		return -1;
+	}
+	return RlePcxDecode(s, data + offset + 128, datasize - 128, bpl, dst);
+}
+
 bool isPalettedSprite(Sprite& s) {
 	return (s.rle == -1 || s.rle == -2 || s.rle == -3 || s.rle == -4 || s.rle == -10);
 }
@@ -789,12 +1302,39 @@ bool isRGBASprite(Sprite& s) {
 	return (s.rle == -11 || s.rle == -12);
 }
 
-uint8_t* readSpriteDataV2(Sprite& s, FILE* file, uint64_t offset, uint32_t datasize, Sff* sff) {
-	uint8_t* px = NULL;
+// Decodes a compressed v2 payload (without its 4 byte length prefix)
+static int decodePayloadV2(Sprite& s, const uint8_t* srcPx, size_t srcLen, PixelSpan dst) {
+	switch (-s.rle) {
+	case 2:
+		return Rle8Decode(s, srcPx, srcLen, dst);
+	case 3:
+		return Rle5Decode(s, srcPx, srcLen, dst);
+	case 4:
+		return Lz5Decode(s, srcPx, srcLen, dst);
+	case 10:
+	case 11:
+	case 12:
+		return PngDecode(s, srcPx, srcLen, dst);
+	}
+	return -1;
+}
+
+// Bytes a v2 sprite decodes to, srcPx is its payload after the length prefix
+static size_t payloadBytesV2(const Sprite& s, const uint8_t* srcPx, size_t srcLen, uint32_t datasize) {
+	if (s.rle == 0) {
+		return std::max((size_t) datasize, spriteTextureBytes(s));
+	}
+	if (s.rle <= -10) {
+		return pngDecodeBytes(s, srcPx, srcLen);
+	}
+	return (size_t) s.Size[0] * s.Size[1];
+}
+
+uint8_t* readSpriteDataV2(Sprite& s, FILE* file, uint64_t offset, uint32_t datasize) {
 	if (s.rle > 0) return NULL;
 
 	if (s.rle == 0) {
-		px = (uint8_t*) malloc(datasize);
+		uint8_t* px = (uint8_t*) malloc(datasize);
 		if (!px) {
 			fprintf(stderr, "Error allocating memory for sprite data\n");
 			return NULL;
@@ -806,224 +1346,1233 @@ uint8_t* readSpriteDataV2(Sprite& s, FILE* file, uint64_t offset, uint32_t datas
 			free(px);
 			return NULL;
 		}
-	} else {
-		size_t srcLen;
-		uint8_t* srcPx = NULL;
-		fseek(file, offset + 4, SEEK_SET);
-		int format = -s.rle;
-		int rc;
-
-		if (datasize < 4) {
-			datasize = 4;
-		}
-		srcLen = datasize - 4;
-		srcPx = (uint8_t*) malloc(srcLen);
-		if (!srcPx) {
-			fprintf(stderr, "Error allocating memory for sprite data\n");
-			return NULL;
-		}
-		rc = fread(srcPx, srcLen, 1, file);
-		if (rc != 1) {
-			fprintf(stderr, "Error reading V2 RLE sprite data.\n");
-			free(srcPx);
-			return NULL;
-		}
+		return px;
+	}
 
-		switch (format) {
-		case 2:
-			px = Rle8Decode(s, srcPx, srcLen);
-			break;
-		case 3:
-			px = Rle5Decode(s, srcPx, srcLen);
-			break;
-		case 4:
-			px = Lz5Decode(s, srcPx, srcLen);
-			break;
-		case 10:
-		case 11:
-		case 12:
-			px = PngDecode(s, srcPx, srcLen);
-			break;
-		}
-		free(srcPx);
+	fseek(file, offset + 4, SEEK_SET);
+	if (datasize < 4) {
+		datasize = 4;
+	}
+	size_t srcLen = datasize - 4;
+	PixelBuffer& src = threadScratch().src;
+	if (!reservePixels(src, srcLen)) {
+		return NULL;
+	}
+	if (fread(src.data, srcLen, 1, file) != 1) {
+		fprintf(stderr, "Error reading V2 RLE sprite data.\n");
+		return NULL;
+	}
+
+	size_t dstLen = payloadBytesV2(s, src.data, srcLen, datasize);
+	uint8_t* px = (uint8_t*) malloc(dstLen ? dstLen : 1);
+	if (!px) {
+		fprintf(stderr, "Error allocating memory for sprite data\n");
+		return NULL;
+	}
+	if (decodePayloadV2(s, src.data, srcLen, { px, dstLen }) != 0) {
+		free(px);
+		return NULL;
 	}
 	return px;
 }
 
-int loadMugenSprite(const char* filename, Sff* sff) {
-	FILE* file;
-	file = fopen(filename, "rb");
-	if (!file) {
-		printf("Error: can not open file %s\n", filename);
+// Same as the FILE* version, but the compressed payload is handed to the
+// decoder as a view into the mapped file (no staging buffer) and the pixels
+// go to the caller's span
+int readSpriteDataV2(Sprite& s, const uint8_t* data, size_t filesize, uint64_t offset, uint32_t datasize, PixelSpan dst) {
+	if (s.rle > 0) return -1;
+
+	if (offset + datasize > filesize) {
+		fprintf(stderr, "Error reading V2 sprite data: out of file bounds\n");
 		return -1;
 	}
-	strncpy(sff->filename, filename, 255);
+
+	if (s.rle == 0) {
+		size_t dstLen = payloadBytesV2(s, NULL, 0, datasize);
+		if (!spanFits(dst, dstLen, "raw")) {
+			return -1;
+		}
+		memcpy(dst.data, data + offset, datasize);
+		memset(dst.data + datasize, 0, dstLen - datasize);
+		return 0;
+	}
+	if (datasize < 4) {
+		fprintf(stderr, "Error reading V2 RLE sprite data.\n");
+		return -1;
+	}
+	// First 4 bytes is the uncompressed length
+	return decodePayloadV2(s, data + offset + 4, datasize - 4, dst);
+}
+
+// Palette texture, none when only the headers are wanted
+static GLuint paletteTexture(Sff* sff, const uint8_t* pal, bool rgb) {
+	return sff->headless ? 0 : sharedPaletteTexture(pal, rgb);
+}
+
+// Palette already loaded with the colors at ofs, -1 if none
+static int findPalette(Sff* sff, const std::map<uint64_t, int>& palByColors, uint32_t ofs, size_t len) {
+	auto it = palByColors.find(hashBytes(sff->file.data() + ofs, len, 0));
+	if (it == palByColors.end()) {
+		return -1;
+	}
+	const Palette& p = sff->palettes[it->second];
+	return memcmp(sff->file.data() + p.data_ofs, sff->file.data() + ofs, len) == 0 ? it->second : -1;
+}
+
+// Parses SFF, palette and sprite headers from the mapped file without decoding
+// any pixels. Fills sprite metadata, payload location, link target, palettes
+// (as textures, unless headless) and usage statistics. If pipeline is given, every sprite with
+// pixel data is queued to it as soon as its header is resolved.
+int readSffHeaders(Sff* sff, SpriteDecodePool* pipeline) {
+	const uint8_t* data = sff->file.data();
+	size_t filesize = sff->file.size();
+	const char* filename = sff->filename;
 
 	uint32_t lofs, tofs;
-	if (readSffHeader(sff, file, &lofs, &tofs) != 0) {
+	if (readSffHeader(sff, data, filesize, &lofs, &tofs) == 0) {
 		printf("Error: reading header %s\n", filename);
 		return -1;
 	}
+	sff->lofs = lofs;
+	sff->tofs = tofs;
 
-	// Print version
+	// Palettes with the same colors share one entry, sprites are remapped to it
+	sff->palettes.clear();
+	sff->numDupPalettes = 0;
+	std::map<uint64_t, int> palByColors;
+	std::vector<int> palRemap;
 	if (sff->header.Ver0 != 1) {
 		std::map<std::array<int, 2>, int> uniquePals;
-		sff->palettes.clear();
+		uint64_t phofs = sff->header.FirstPaletteHeaderOffset;
+		if (phofs + (uint64_t) sff->header.NumberOfPalettes * sizeof(PaletteHeaderV2) > filesize) {
+			printf("Failed to read palette header: %s", filename);
+			return -1;
+		}
 		sff->palettes.reserve(sff->header.NumberOfPalettes);
+		palRemap.resize(sff->header.NumberOfPalettes);
+		const PaletteHeaderV2* palTable = (const PaletteHeaderV2*) (data + phofs);
 		for (uint32_t i = 0; i < sff->header.NumberOfPalettes; i++) {
-			fseek(file, sff->header.FirstPaletteHeaderOffset + i * 16, SEEK_SET);
-			int16_t gn[3];
-			if (fread(gn, sizeof(uint16_t), 3, file) != 3) {
-				printf("Failed to read palette group: %s", filename);
-				return -1;
+			const PaletteHeaderV2& ph = palTable[i];
+			// printf("Palette %d: Group %d, Number %d, ColNumber %d\n", i, ph.Group, ph.Number, ph.NumColors);
+
+			// Same group and number means the same palette
+			std::array<int, 2> key = { ph.Group, ph.Number };
+			auto it = uniquePals.find(key);
+			if (it != uniquePals.end()) {
+				palRemap[i] = palRemap[it->second];
+				sff->numDupPalettes++;
+				continue;
 			}
-			// printf("Palette %d: Group %d, Number %d, ColNumber %d\n", i, gn[0], gn[1], gn[2]);
-
-			uint16_t link;
-			if (fread(&link, sizeof(uint16_t), 1, file) != 1) {
-				printf("Failed to read palette link: %s", filename);
+			uniquePals[key] = i;
+			if ((uint64_t) lofs + ph.DataOffset + 1024 > filesize) {
+				printf("Failed to read palette data: %s", filename);
 				return -1;
 			}
-			// printf("Palette link: %d\n", link);
-
-			uint32_t ofs, siz;
-			if (fread(&ofs, sizeof(uint32_t), 1, file) != 1) {
-				printf("Failed to read palette offset: %s", filename);
-				return -1;
-			}
-			if (fread(&siz, sizeof(uint32_t), 1, file) != 1) {
-				printf("Failed to read palette size: %s", filename);
-				return -1;
-			}
-
-			// Check if the palette is unique
-			std::array<int, 2> key = { gn[0], gn[1] };
-			if (uniquePals.find(key) == uniquePals.end()) {
-				fseek(file, lofs + ofs, SEEK_SET);
-				uint32_t rgba[256];
-				if (fread(rgba, sizeof(uint32_t), 256, file) != 256) {
-					printf("Failed to read palette data: %s", filename);
-					return -1;
-				}
-				sff->palettes[i].texture_id = generateTextureFromPaletteRGBA(rgba);
-				uniquePals[key] = i;
-			} else {
-				// If the palette is not unique, use the existing one
-				printf("Palette %d(%d,%d) is not unique, using palette %d\nUntested code\n", i, gn[0], gn[1], uniquePals[key]);
-				sff->palettes[i].texture_id = sff->palettes[uniquePals[key]].texture_id;
+			int found = findPalette(sff, palByColors, lofs + ph.DataOffset, 1024);
+			if (found >= 0) {
+				palRemap[i] = found;
+				sff->numDupPalettes++;
+				continue;
 			}
+			sff->palettes.emplace_back(paletteTexture(sff, data + lofs + ph.DataOffset, false));
+			sff->palettes.back().data_ofs = lofs + ph.DataOffset;
+			palRemap[i] = sff->palettes.size() - 1;
+			palByColors[hashBytes(data + lofs + ph.DataOffset, 1024, 0)] = palRemap[i];
 		}
 	}
 
+	// A count the file can not hold is rejected before any allocation
+	uint64_t shofs = sff->header.FirstSpriteHeaderOffset;
+	if (sff->header.Ver0 == 2 && shofs + (uint64_t) sff->header.NumberOfSprites * sizeof(SpriteHeaderV2) > filesize) {
+		fprintf(stderr, "Error reading sprite v2 header table\n");
+		return -1;
+	}
+	if (sff->header.Ver0 == 1 && sff->header.NumberOfSprites > filesize / sizeof(SpriteHeaderV1)) {
+		fprintf(stderr, "Error: %u sprites do not fit in %s\n", sff->header.NumberOfSprites, filename);
+		return -1;
+	}
 	sff->sprites.clear();
-	sff->sprites.reserve(sff->header.NumberOfSprites);
-	Sprite* prev = NULL;
+	sff->sprites.resize(sff->header.NumberOfSprites);
+	sff->palette_usage.clear();
+	sff->compression_format_usage.clear();
+	int prev = -1;
 	sff->numLinkedSprites = 0;
-	long shofs = sff->header.FirstSpriteHeaderOffset;
+
+	// v2 headers are a flat table: decode all of them in one pass
+	std::vector<uint16_t> links;
+	if (sff->header.Ver0 == 2) {
+		links.resize(sff->header.NumberOfSprites);
+		decodeSpriteHeadersV2((const SpriteHeaderV2*) (data + shofs), sff->header.NumberOfSprites, lofs, tofs, sff->sprites.data(), links.data());
+		for (Sprite& s : sff->sprites) {
+			if (s.palidx >= 0 && (size_t) s.palidx < palRemap.size()) {
+				s.palidx = palRemap[s.palidx];
+			}
+		}
+	}
+
+	uint64_t readahead = 0;
 	for (uint32_t i = 0; i < sff->header.NumberOfSprites; i++) {
-		uint32_t xofs, size;
+		Sprite& s = sff->sprites[i];
+		uint32_t xofs = 0, size = 0;
 		uint16_t indexOfPrevious;
-		fseek(file, shofs, SEEK_SET);
-		switch (sff->header.Ver0) {
-		case 1:
-			if (readSpriteHeaderV1(sff->sprites[i], file, &xofs, &size, &indexOfPrevious) != 0) {
-				return -1;
+		if (sff->header.Ver0 == 1) {
+			// v1 subheaders are a chain, the next position is known only after
+			// this one. Keep the kernel reading ahead of the walker instead of
+			// faulting in one page at a time.
+			if (shofs + V1_READAHEAD / 2 > readahead || shofs + V1_READAHEAD < readahead) {
+				sff->file.prefetch(shofs, V1_READAHEAD);
+				readahead = shofs + V1_READAHEAD;
 			}
-			break;
-		case 2:
-			if (readSpriteHeaderV2(sff->sprites[i], file, &xofs, &size, lofs, tofs, &indexOfPrevious) != 0) {
+			if (readSpriteHeaderV1(s, data, filesize, shofs, &xofs, &size, &indexOfPrevious) != 0) {
 				return -1;
 			}
-			break;
+		} else {
+			size = s.data_len;
+			xofs = s.data_ofs;
+			indexOfPrevious = links[i];
 		}
 
 		if (size == 0) {
 			sff->numLinkedSprites++;
 			if (indexOfPrevious < i) {
-				spriteCopy(sff->sprites[i], sff->sprites[indexOfPrevious]);
+				spriteCopy(s, sff->sprites[indexOfPrevious]);
+				const Sprite& target = sff->sprites[indexOfPrevious];
+				s.link = target.link >= 0 ? target.link : indexOfPrevious;
 				// printf("Info: Sprite[%d] use prev Sprite[%d]\n", i, indexOfPrevious);
 			} else {
 				printf("Warning: Sprite %d has no size\n", i);
-				sff->sprites[i].palidx = 0;
+				s.palidx = 0;
 			}
 		} else {
-			uint8_t* data = NULL;
-			int palette_used = -1;
-			int compression_format_used = -1;
-			bool character = true;
-			switch (sff->header.Ver0) {
-			case 1:
-				data = readSpriteDataV1(sff->sprites[i], file, sff, shofs + 32, size, xofs, prev, character);
-				if (!data) {
-					fprintf(stderr, "Error reading sprite v1 data\n");
-					return -1;
+			if (sff->header.Ver0 == 1) {
+				// PCX data runs up to the next subheader, except for the last one
+				uint64_t offset = shofs + 32;
+				uint32_t datasize = size;
+				if (xofs > offset) {
+					datasize = xofs - offset;
 				}
-				palette_used = sff->sprites[i].palidx;
-				sff->palette_usage[palette_used]++;
-				break;
-			case 2:
-				data = readSpriteDataV2(sff->sprites[i], file, xofs, size, sff);
-				if (!data) {
-					fprintf(stderr, "Error reading sprite v2 data\n");
+				uint16_t bpl;
+				if (readPcxHeader(s, data, filesize, offset, &bpl) != 0) {
+					fprintf(stderr, "Error reading sprite PCX header\n");
 					return -1;
 				}
-				if (isPalettedSprite(sff->sprites[i])) {
-					palette_used = sff->sprites[i].palidx;
-					sff->palette_usage[palette_used]++;
+				s.data_ofs = offset;
+				s.data_len = datasize;
+
+				// "same palette as previous" flag is at subheader + 18
+				bool paletteSame = data[shofs + 18] != 0 && prev >= 0;
+				if (paletteSame) {
+					s.palidx = sff->sprites[prev].palidx;
+					if (s.palidx < 0) {
+						fprintf(stderr, "Error: invalid prev palette index %d\n", s.palidx);
+						return -1;
+					}
+				} else {
+					// Palette is the last 768 bytes of PCX data
+					if (datasize < 128 + 768 || offset + datasize > filesize) {
+						fprintf(stderr, "Error reading palette rgb data\n");
+						return -1;
+					}
+					uint32_t palofs = offset + datasize - 768;
+					s.palidx = findPalette(sff, palByColors, palofs, 768);
+					if (s.palidx >= 0) {
+						sff->numDupPalettes++;
+					} else {
+						sff->palettes.emplace_back(paletteTexture(sff, data + palofs, true));
+						sff->palettes.back().data_ofs = palofs;
+						s.palidx = sff->palettes.size() - 1;
+						palByColors[hashBytes(data + palofs, 768, 0)] = s.palidx;
+					}
 				}
-				break;
-			default:
-				fprintf(stderr, "Warning: unsupported sprite version: %d.x.x.x\n", sff->header.Ver0);
-				break;
+				sff->palette_usage[s.palidx]++;
+			} else {
+				if (isPalettedSprite(s)) {
+					sff->palette_usage[s.palidx]++;
+				}
+			}
+			sff->compression_format_usage[s.rle]++;
+			if (sff->hashPayloads && (uint64_t) s.data_ofs + s.data_len <= filesize) {
+				s.hash = hashBytes(data + s.data_ofs, s.data_len, 0);
 			}
-			compression_format_used = sff->sprites[i].rle;
-			sff->compression_format_usage[compression_format_used]++;
-			if (data) {
-				if (isRGBASprite(sff->sprites[i]))	// PNG Image (RGBA)
-					sff->sprites[i].texture_id = generateTextureRGBAFromSprite(sff->sprites[i].Size[0], sff->sprites[i].Size[1], data);
-				else	// Paletted Image (R only)
-					sff->sprites[i].texture_id = generateTextureFromSprite(sff->sprites[i].Size[0], sff->sprites[i].Size[1], data);
-				free(data);
+			if (pipeline) {
+				pipeline->push(i);
 			}
 
 			// if use previous sprite Group 9000 and Number 0 only (fix for SFF v1)
-			if (sff->sprites[i].Group == 9000) {
-				if (sff->sprites[i].Number == 0) {
-					prev = &sff->sprites[i];
-				}
-			} else {
-				prev = &sff->sprites[i];
+			if (s.Group != 9000 || s.Number == 0) {
+				prev = i;
 			}
 		}
 
 		if (sff->header.Ver0 == 1) {
 			shofs = xofs;
 		} else {
-			shofs += 28;
+			shofs += sizeof(SpriteHeaderV2);
 		}
 
-		// printSprite(&sff->sprites[i]);
+		// printSprite(&s);
 	}
 
-	// if SFF == v1 then update total palette
+	// Total of unique palettes
+	sff->header.NumberOfPalettes = sff->palettes.size();
+
+	return 0;
+}
+
+// Bytes the pixels of s take once decoded (R8 indices or RGBA), 0 for
+// linked/empty sprites or an unreadable PNG header
+size_t spriteDecodeBytes(Sff* sff, const Sprite& s) {
+	if (s.link >= 0 || s.data_len == 0) {
+		return 0;
+	}
 	if (sff->header.Ver0 == 1) {
-		sff->header.NumberOfPalettes = sff->palettes.size();
+		return (size_t) s.Size[0] * s.Size[1];
+	}
+	if ((uint64_t) s.data_ofs + s.data_len > sff->file.size() || s.data_len < 4) {
+		return s.rle == 0 ? spriteTextureBytes(s) : 0;
+	}
+	const uint8_t* payload = sff->file.data() + s.data_ofs;
+	return payloadBytesV2(s, payload + 4, s.data_len - 4, s.data_len);
+}
+
+// First pixel of row in [from, to) that is not transparent, to if none.
+// bpp 1: index other than 0, bpp 4: alpha other than 0.
+static inline size_t firstOpaque(const uint8_t* row, size_t from, size_t to, size_t bpp) {
+	size_t x = from;
+	if (bpp == 1) {
+		for (uint64_t v; x + 8 <= to; x += 8) {
+			memcpy(&v, row + x, 8);
+			if (v) {
+				break;
+			}
+		}
+	}
+	while (x < to && !row[x * bpp + bpp - 1]) {
+		x++;
+	}
+	return x;
+}
+
+// One past the last pixel of row in [from, to) that is not transparent, from if none
+static inline size_t lastOpaque(const uint8_t* row, size_t from, size_t to, size_t bpp) {
+	size_t x = to;
+	if (bpp == 1) {
+		for (uint64_t v; x >= from + 8; x -= 8) {
+			memcpy(&v, row + x - 8, 8);
+			if (v) {
+				break;
+			}
+		}
+	}
+	while (x > from && !row[(x - 1) * bpp + bpp - 1]) {
+		x--;
+	}
+	return x;
+}
+
+// Sets s.Bounds from the decoded pixels (len bytes, texture layout). The rows
+// above and below the box are scanned once, the rows between only outside
+// the columns already known to hold a pixel.
+void spriteBounds(Sprite& s, const uint8_t* px, size_t len) {
+	size_t w = s.Size[0], h = s.Size[1];
+	size_t bpp = (s.rle == -11 || s.rle == -12) ? 4 : 1;
+	size_t pitch = w * bpp;
+	s.hasBounds = false;
+	if (len < pitch * h) {
+		return;
+	}
+	memset(s.Bounds, 0, sizeof(s.Bounds));
+	s.hasBounds = true;
+	size_t top = 0;
+	while (top < h && firstOpaque(px + top * pitch, 0, w, bpp) == w) {
+		top++;
+	}
+	if (top == h) {
+		return;
+	}
+	size_t bottom = h;
+	while (bottom - 1 > top && firstOpaque(px + (bottom - 1) * pitch, 0, w, bpp) == w) {
+		bottom--;
+	}
+	size_t left = firstOpaque(px + top * pitch, 0, w, bpp);
+	size_t right = lastOpaque(px + top * pitch, left, w, bpp);
+	for (size_t y = top + 1; y < bottom; y++) {
+		const uint8_t* row = px + y * pitch;
+		left = firstOpaque(row, 0, left, bpp);
+		right = lastOpaque(row, right, w, bpp);
+	}
+	s.Bounds[0] = left;
+	s.Bounds[1] = top;
+	s.Bounds[2] = right - left;
+	s.Bounds[3] = bottom - top;
+}
+
+// Linked sprites take the box of the sprite they share pixels with
+static void copySpriteBounds(Sprite& dst, const Sprite& src) {
+	memcpy(dst.Bounds, src.Bounds, sizeof(dst.Bounds));
+	dst.hasBounds = src.hasBounds;
+}
+
+static int decodePixelsInto(Sff* sff, Sprite& s, PixelSpan dst) {
+	if (sff->header.Ver0 == 1) {
+		return readSpriteDataV1(s, sff->file.data(), sff->file.size(), s.data_ofs, s.data_len, dst);
+	}
+
+	// PNG sprites may already be decoded in the pixel cache
+	bool cached = sff->pixelCacheBudget > 0 && s.rle <= -10 && (uint64_t) s.data_ofs + s.data_len <= sff->file.size();
+	uint64_t hash = 0;
+	if (cached) {
+		hash = s.hash ? s.hash : hashBytes(sff->file.data() + s.data_ofs, s.data_len, 0);
+		if (readCachedPixels(s, hash, dst) == 0) {
+			return 0;
+		}
+	}
+	if (readSpriteDataV2(s, sff->file.data(), sff->file.size(), s.data_ofs, s.data_len, dst) != 0) {
+		return -1;
+	}
+	if (cached) {
+		writeCachedPixels(s, hash, dst.data);
+	}
+	return 0;
+}
+
+// Decodes pixels of sprite s from the mapped file into dst, which must hold
+// spriteDecodeBytes(s), and sets its Bounds while the pixels are still in
+// cache. Returns -1 for linked/empty sprites or on error.
+int decodeSpriteInto(Sff* sff, Sprite& s, PixelSpan dst) {
+	if (s.link >= 0 || s.data_len == 0 || decodePixelsInto(sff, s, dst) != 0) {
+		return -1;
+	}
+	spriteBounds(s, dst.data, dst.len);
+	return 0;
+}
+
+// Decodes s into buf, grown to fit. Returns buf.data, NULL for linked/empty
+// sprites or on error. A sprite of 0x0 pixels decodes to no bytes and still
+// returns buf.data.
+uint8_t* decodeSprite(Sff* sff, Sprite& s, PixelBuffer& buf) {
+	size_t len = spriteDecodeBytes(sff, s);
+	if (s.link >= 0 || s.data_len == 0 || !reservePixels(buf, len ? len : 1)) {
+		return NULL;
+	}
+	return decodeSpriteInto(sff, s, { buf.data, len }) == 0 ? buf.data : NULL;
+}
+
+// 64-bit content hash (xxHash64 algorithm)
+static const uint64_t XXH_P1 = 11400714785074694791ULL;
+static const uint64_t XXH_P2 = 14029467366897019727ULL;
+static const uint64_t XXH_P3 = 1609587929392839161ULL;
+static const uint64_t XXH_P4 = 9650029242287828579ULL;
+static const uint64_t XXH_P5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+	acc += input * XXH_P2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_P1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t val) {
+	acc ^= xxhRound(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t hashBytes(const void* data, size_t len, uint64_t seed) {
+	const uint8_t* p = (const uint8_t*) data;
+	const uint8_t* end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH_P1 + XXH_P2;
+		uint64_t v2 = seed + XXH_P2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_P1;
+		const uint8_t* limit = end - 32;
+		do {
+			uint64_t w[4];
+			memcpy(w, p, 32);
+			v1 = xxhRound(v1, w[0]);
+			v2 = xxhRound(v2, w[1]);
+			v3 = xxhRound(v3, w[2]);
+			v4 = xxhRound(v4, w[3]);
+			p += 32;
+		} while (p <= limit);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxhMerge(h, v1);
+		h = xxhMerge(h, v2);
+		h = xxhMerge(h, v3);
+		h = xxhMerge(h, v4);
+	} else {
+		h = seed + XXH_P5;
+	}
+	h += (uint64_t) len;
+
+	while (p + 8 <= end) {
+		uint64_t k;
+		memcpy(&k, p, 8);
+		h ^= xxhRound(0, k);
+		h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		uint32_t k;
+		memcpy(&k, p, 4);
+		h ^= (uint64_t) k * XXH_P1;
+		h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= (*p) * XXH_P5;
+		h = rotl64(h, 11) * XXH_P1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+static GLuint uploadSprite(Sprite& s, uint8_t* px) {
+	if (spriteTextureBytes(s) == 0) {
+		return 0;	// 0x0 sprite, nothing to draw
+	}
+	if (isRGBASprite(s))	// PNG Image (RGBA)
+		return generateTextureRGBAFromSprite(s.Size[0], s.Size[1], px);
+	else	// Paletted Image (R only)
+		return generateTextureFromSprite(s.Size[0], s.Size[1], px);
+}
+
+size_t spriteTextureBytes(const Sprite& s) {
+	size_t bpp = (s.rle == -11 || s.rle == -12) ? 4 : 1;
+	return (size_t) s.Size[0] * s.Size[1] * bpp;
+}
+
+// Texture memory of an Sff, shared receives the part also used by other open files
+size_t sffTextureBytes(const Sff& sff, size_t* shared) {
+	size_t total = 0, common = 0;
+	for (const Palette& p : sff.palettes) {
+		if (p.texture_id) {
+			total += 256 * 4;
+			common += pooledTextureRefs(p.texture_id) > 1 ? 256 * 4 : 0;
+		}
+	}
+	if (sff.lazy) {
+		total += sff.cache.used;
+	} else {
+		for (const Sprite& s : sff.sprites) {
+			if (s.link < 0 && s.texture_id) {
+				size_t bytes = spriteTextureBytes(s);
+				total += bytes;
+				common += pooledTextureRefs(s.texture_id) > 1 ? bytes : 0;
+			}
+		}
+	}
+	if (shared) {
+		*shared = common;
+	}
+	return total;
+}
+
+// Headers come from the index sidecar when it is current, otherwise from the SFF
+static int loadSffHeaders(Sff* sff, SpriteDecodePool* pipeline) {
+	if (sff->useIndex && readSffIndex(sff, pipeline) == 0) {
+		return 0;
+	}
+	if (readSffHeaders(sff, pipeline) != 0) {
+		return -1;
+	}
+	if (sff->useIndex) {
+		writeSffIndex(sff);
+	}
+	return 0;
+}
+
+// Size and format of the texture of s
+uint64_t pixelLayout(const Sprite& s) {
+	return ((uint64_t) s.Size[0] << 32) | ((uint64_t) s.Size[1] << 16) | (uint64_t) (s.rle == -11 || s.rle == -12);
+}
+
+// Identifies decoded pixels, the layout goes in the seed so equal bytes of
+// another size or format do not match
+uint64_t pixelHash(const Sprite& s, const uint8_t* px) {
+	return hashBytes(px, spriteTextureBytes(s), pixelLayout(s));
+}
+
+// Uploads a decoded sprite unless an earlier one has the very same pixels,
+// then it shares that texture the same way linked sprites do. Textures of
+// other open files with the same pixels are taken from the pool. A hash
+// match of another size or format is a collision and gets its own texture.
+static void uploadDecodedSprite(Sff* sff, const DecodedSprite& d) {
+	Sprite& s = sff->sprites[d.idx];
+	s.Size[0] = d.Size[0];
+	s.Size[1] = d.Size[1];
+	memcpy(s.Bounds, d.Bounds, sizeof(s.Bounds));
+	s.hasBounds = d.hasBounds;
+	if (spriteTextureBytes(s) == 0) {
+		s.texture_id = 0;
+		return;
+	}
+	uint64_t layout = pixelLayout(s);
+	auto it = sff->pixelOwners.find(d.hash);
+	if (it != sff->pixelOwners.end() && pixelLayout(sff->sprites[it->second]) == layout) {
+		s.texture_id = sff->sprites[it->second].texture_id;
+		s.link = it->second;
+		sff->numDedupSprites++;
+		sff->dedupBytes += spriteTextureBytes(s);
+		return;
+	}
+	s.texture_id = acquirePooledTexture(d.hash, layout);
+	if (!s.texture_id) {
+		s.texture_id = uploadSprite(s, d.px);
+		addPooledTexture(d.hash, layout, s.texture_id, spriteTextureBytes(s));
+	}
+	sff->pixelOwners.emplace(d.hash, d.idx);
+}
+
+// Keeps the pixel cache in its budget after decodes that may have added files.
+// slack lets lazy loads write a while before the directory is scanned again.
+static void trimPixelCacheAfterDecode(const Sff* sff, size_t slack) {
+	if (sff->pixelCacheBudget) {
+		trimPixelCacheWrites(sff->pixelCacheBudget, slack);
+	}
+}
+
+int loadMugenSprite(const char* filename, Sff* sff) {
+	// Map the whole file once, headers and payloads are read straight from it.
+	// A batch job may have read it already (SffBatchReader).
+	if (!sff->file.data() && !sff->file.open(filename)) {
+		printf("Error: can not open file %s\n", filename);
+		return -1;
+	}
+	strncpy(sff->filename, filename, 255);
+
+	if (sff->lazy) {
+		// Sprites are decoded by getSpriteTexture when first displayed
+		if (loadSffHeaders(sff, nullptr) != 0) {
+			sff->file.close();
+			return -1;
+		}
+		return 0;
+	}
+
+	// Workers start decoding while the headers are still being walked
+	SpriteDecodePool* pool = new SpriteDecodePool();
+	pool->start(sff, sff->numThreads);
+	if (loadSffHeaders(sff, pool) != 0) {
+		delete pool;
+		sff->file.close();
+		return -1;
 	}
+	pool->finish();
 
+	if (sff->progressive) {
+		// Decode in background, the caller uploads with uploadLoadedSprites every frame
+		sff->numLoaded = 0;
+		sff->loader = pool;
+		return 0;
+	}
+
+	// Upload here on the GL thread
+	DecodedSprite d;
+	bool failed = false;
+	while (pool->pop(d)) {
+		if (!d.px) {
+			fprintf(stderr, "Error reading sprite v%d data\n", sff->header.Ver0);
+			failed = true;
+			break;
+		}
+		uploadDecodedSprite(sff, d);
+		pool->recycle(d);
+	}
+	sff->pngStats = pool->pngStats();
+	delete pool;
+	trimPixelCacheAfterDecode(sff, 0);
+	if (failed) {
+		sff->file.close();
+		return -1;
+	}
+
+	// Linked sprites share the texture of their target
+	for (uint32_t i = 0; i < sff->header.NumberOfSprites; i++) {
+		Sprite& s = sff->sprites[i];
+		if (s.link >= 0) {
+			s.texture_id = sff->sprites[s.link].texture_id;
+			s.Size[0] = sff->sprites[s.link].Size[0];
+			s.Size[1] = sff->sprites[s.link].Size[1];
+			copySpriteBounds(s, sff->sprites[s.link]);
+		}
+	}
+
+	sff->file.close();
 	return 0;
 }
 
+// State of a work position
+#define SLOT_HELD	0	// PNG sprite waiting for finish()
+#define SLOT_QUEUED	1	// in plain or a worker queue
+#define SLOT_TAKEN	2	// decoding or decoded
+
+void SpriteDecodePool::start(Sff* s, unsigned numThreads) {
+	stop();
+	sff = s;
+	work.clear();
+	work.reserve(sff->header.NumberOfSprites);
+	workState.clear();
+	plain.clear();
+	nextPlain = 0;
+	held.clear();
+	numQueued = 0;
+	numTaken = 0;
+	cancel = false;
+	closed = false;
+	numDelivered = 0;
+	png = {};
+
+	if (numThreads == 0) {
+		numThreads = std::thread::hardware_concurrency();
+	}
+	if (numThreads == 0) {
+		numThreads = 1;
+	}
+	queues.assign(numThreads, std::deque<size_t>());
+	running = numThreads;
+	for (unsigned i = 0; i < numThreads; i++) {
+		threads.emplace_back(&SpriteDecodePool::worker, this, i);
+	}
+}
+
+void SpriteDecodePool::push(uint32_t idx) {
+	std::lock_guard<std::mutex> lock(mtx);
+	size_t pos = work.size();
+	work.push_back(idx);
+	if (sff->sprites[idx].rle <= -10) {
+		workState.push_back(SLOT_HELD);
+		held.push_back(pos);
+		return;
+	}
+	workState.push_back(SLOT_QUEUED);
+	plain.push_back(pos);
+	numQueued++;
+	hasWork.notify_one();
+}
+
+// Deals the PNG sprites, largest first, so that the small ones are left to
+// fill the gaps at the end
+void SpriteDecodePool::finish() {
+	std::lock_guard<std::mutex> lock(mtx);
+	std::stable_sort(held.begin(), held.end(), [this](size_t a, size_t b) {
+		return sff->sprites[work[a]].data_len > sff->sprites[work[b]].data_len;
+	});
+	for (size_t i = 0; i < held.size(); i++) {
+		workState[held[i]] = SLOT_QUEUED;
+		queues[i % queues.size()].push_back(held[i]);
+	}
+	numQueued += held.size();
+	held.clear();
+	closed = true;
+	hasWork.notify_all();
+	notEmpty.notify_all();
+}
+
+bool SpriteDecodePool::done() {
+	std::lock_guard<std::mutex> lock(mtx);
+	return closed && numDelivered == work.size();
+}
+
+// With maxReady sprites waiting for delivery only the next one to deliver
+// may be taken, so the consumer always gets it
+bool SpriteDecodePool::canTake() {
+	if (numTaken - numDelivered < maxReady) {
+		return numQueued > 0;
+	}
+	return numDelivered < work.size() && workState[numDelivered] == SLOT_QUEUED;
+}
+
+// Next work position for worker self: a non-PNG sprite, else the largest PNG
+// sprite of its queue, else the largest one left in another queue. Entries taken out of order
+// by canTake's exception are skipped. Call with mtx held and canTake() true.
+size_t SpriteDecodePool::take(unsigned self) {
+	size_t pos;
+	if (numTaken - numDelivered >= maxReady) {
+		pos = numDelivered;
+	} else {
+		while (nextPlain < plain.size() && workState[plain[nextPlain]] == SLOT_TAKEN) {
+			nextPlain++;
+		}
+		for (auto& q : queues) {
+			while (!q.empty() && workState[q.front()] == SLOT_TAKEN) {
+				q.pop_front();
+			}
+		}
+		std::deque<size_t>* q = &queues[self];
+		if (nextPlain < plain.size()) {
+			q = nullptr;
+		} else if (q->empty()) {
+			for (auto& other : queues) {
+				if (!other.empty() && (q->empty() || sff->sprites[work[other.front()]].data_len > sff->sprites[work[q->front()]].data_len)) {
+					q = &other;
+				}
+			}
+		}
+		if (q) {
+			pos = q->front();
+			q->pop_front();
+		} else {
+			pos = plain[nextPlain++];
+		}
+	}
+	workState[pos] = SLOT_TAKEN;
+	numQueued--;
+	numTaken++;
+	return pos;
+}
+
+void SpriteDecodePool::worker(unsigned self) {
+	for (;;) {
+		size_t pos;
+		PixelBuffer buf = { NULL, 0 };
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			hasWork.wait(lock, [this] { return cancel || canTake() || (closed && numTaken == work.size()); });
+			if (cancel || !canTake()) {
+				break;
+			}
+			pos = take(self);
+			if (!spare.empty()) {
+				buf = spare.back();
+				spare.pop_back();
+			}
+		}
+		// Decode into a copy, the GL thread may be reading the Sff meanwhile
+		uint32_t idx = work[pos];
+		Sprite s = sff->sprites[idx];
+		bool isPng = s.rle <= -10;
+		auto t0 = std::chrono::steady_clock::now();
+		uint8_t* px = decodeSprite(sff, s, buf);
+		auto t1 = std::chrono::steady_clock::now();
+		uint64_t hash = px ? pixelHash(s, px) : 0;
+
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!px && buf.data) {
+			spare.push_back(buf);
+		}
+		if (isPng && px) {
+			if (png.sprites == 0) {
+				pngFirst = t0;
+				pngLast = t1;
+			}
+			pngFirst = std::min(pngFirst, t0);
+			pngLast = std::max(pngLast, t1);
+			png.sprites++;
+			png.bytesIn += s.data_len;
+			png.pixelsOut += (uint64_t) s.Size[0] * s.Size[1];
+		}
+		if (cancel) {
+			free(px);
+			break;
+		}
+		ready[pos] = { idx, px, buf.cap, { s.Size[0], s.Size[1] }, { s.Bounds[0], s.Bounds[1], s.Bounds[2], s.Bounds[3] }, s.hasBounds, hash };
+		if (pos == numDelivered) {
+			notEmpty.notify_one();
+		}
+	}
+	std::lock_guard<std::mutex> lock(mtx);
+	running--;
+	notEmpty.notify_all();
+}
+
+// True if the sprite to deliver next is decoded. Call with mtx held.
+bool SpriteDecodePool::nextReady() {
+	return !ready.empty() && ready.begin()->first == numDelivered;
+}
+
+DecodedSprite SpriteDecodePool::popNext() {
+	DecodedSprite out = ready.begin()->second;
+	ready.erase(ready.begin());
+	numDelivered++;
+	hasWork.notify_one();
+	if (nextReady()) {
+		notEmpty.notify_one();
+	}
+	return out;
+}
+
+bool SpriteDecodePool::pop(DecodedSprite& out) {
+	std::unique_lock<std::mutex> lock(mtx);
+	notEmpty.wait(lock, [this] { return nextReady() || (closed && numDelivered == work.size()) || running == 0; });
+	if (!nextReady()) {
+		return false;
+	}
+	out = popNext();
+	return true;
+}
+
+bool SpriteDecodePool::tryPop(DecodedSprite& out) {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!nextReady()) {
+		return false;
+	}
+	out = popNext();
+	return true;
+}
+
+// The buffer goes to the next sprite a worker decodes
+void SpriteDecodePool::recycle(DecodedSprite& d) {
+	if (d.px) {
+		std::lock_guard<std::mutex> lock(mtx);
+		spare.push_back({ d.px, d.cap });
+	}
+	d.px = NULL;
+}
+
+void SpriteDecodePool::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		cancel = true;
+	}
+	hasWork.notify_all();
+	for (auto& t : threads) {
+		t.join();
+	}
+	threads.clear();
+	for (auto& r : ready) {
+		free(r.second.px);
+	}
+	ready.clear();
+	for (auto& b : spare) {
+		free(b.data);
+	}
+	spare.clear();
+	running = 0;
+}
+
+PngBatchStats SpriteDecodePool::pngStats() {
+	std::lock_guard<std::mutex> lock(mtx);
+	PngBatchStats stats = png;
+	stats.seconds = png.sprites ? std::chrono::duration<double>(pngLast - pngFirst).count() : 0;
+	return stats;
+}
+
+// Returns the texture of sprite idx. In lazy mode the sprite is decoded and
+// uploaded on first use, and least recently used textures are released once
+// the cache budget is exceeded.
+GLuint getSpriteTexture(Sff& sff, size_t idx) {
+	Sprite& s = sff.sprites[idx];
+	if (!sff.lazy) {
+		// Progressive load resolves linked sprites as their target arrives
+		if (s.link >= 0 && s.texture_id != sff.sprites[s.link].texture_id) {
+			s.texture_id = sff.sprites[s.link].texture_id;
+			s.Size[0] = sff.sprites[s.link].Size[0];
+			s.Size[1] = sff.sprites[s.link].Size[1];
+			copySpriteBounds(s, sff.sprites[s.link]);
+		}
+		return s.texture_id;
+	}
+
+	uint32_t root = s.link >= 0 ? s.link : idx;
+	Sprite& r = sff.sprites[root];
+	SpriteCache& cache = sff.cache;
+	auto it = cache.pos.find(root);
+	if (it != cache.pos.end()) {
+		cache.order.splice(cache.order.begin(), cache.order, it->second);
+	} else if (r.data_len > 0) {
+		uint8_t* px = decodeSprite(&sff, r, threadScratch().px);
+		if (!px) {
+			fprintf(stderr, "Error decoding sprite %u\n", root);
+			return 0;
+		}
+		r.texture_id = uploadSprite(r, px);
+		trimPixelCacheAfterDecode(&sff, sff.pixelCacheBudget / 8);
+		cache.order.push_front(root);
+		cache.pos[root] = cache.order.begin();
+		cache.used += spriteTextureBytes(r);
+
+		// Evict, but never the sprite just requested
+		while (cache.budget && cache.used > cache.budget && cache.order.size() > 1) {
+			uint32_t victim = cache.order.back();
+			Sprite& v = sff.sprites[victim];
+			glDeleteTextures(1, &v.texture_id);
+			v.texture_id = 0;
+			cache.used -= spriteTextureBytes(v);
+			cache.pos.erase(victim);
+			cache.order.pop_back();
+		}
+	}
+	s.texture_id = r.texture_id;
+	s.Size[0] = r.Size[0];
+	s.Size[1] = r.Size[1];
+	copySpriteBounds(s, r);
+	return s.texture_id;
+}
+
+// Uploads sprites finished by the background decoder of a progressive load,
+// for at most budget_ms so the UI keeps its frame rate. Returns true while
+// sprites are still loading.
+bool uploadLoadedSprites(Sff& sff, double budget_ms) {
+	if (!sff.loader) {
+		return false;
+	}
+	auto start = std::chrono::steady_clock::now();
+	DecodedSprite d;
+	while (sff.loader->tryPop(d)) {
+		if (d.px) {
+			uploadDecodedSprite(&sff, d);
+			sff.loader->recycle(d);
+		} else {
+			fprintf(stderr, "Error reading sprite %u\n", d.idx);
+		}
+		sff.numLoaded++;
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		if (elapsed.count() >= budget_ms) {
+			break;
+		}
+	}
+
+	if (!sff.loader->done()) {
+		return true;
+	}
+	// All sprites are in, release the workers and the file
+	sff.pngStats = sff.loader->pngStats();
+	delete sff.loader;
+	sff.loader = nullptr;
+	trimPixelCacheAfterDecode(&sff, 0);
+	for (uint32_t i = 0; i < sff.header.NumberOfSprites; i++) {
+		getSpriteTexture(sff, i);
+	}
+	sff.file.close();
+	return false;
+}
+
 void deleteMugenSprite(Sff& sff) {
 	uint32_t i;
+	if (sff.loader) {
+		delete sff.loader;
+		sff.loader = nullptr;
+	}
 	for (i = 0; i < sff.header.NumberOfPalettes; i++) {
-		glDeleteTextures(1, &sff.palettes[i].texture_id);
+		releaseTexture(sff.palettes[i].texture_id);
 	}
-	for (i = 0; i < sff.header.NumberOfSprites; i++) {
-		glDeleteTextures(1, &sff.sprites[i].texture_id);
+	if (sff.lazy) {
+		for (uint32_t idx : sff.cache.order) {
+			glDeleteTextures(1, &sff.sprites[idx].texture_id);
+		}
+		sff.cache.order.clear();
+		sff.cache.pos.clear();
+		sff.cache.used = 0;
+	} else {
+		// One reference per texture, held by the sprite that uploaded it
+		for (i = 0; i < sff.header.NumberOfSprites; i++) {
+			if (sff.sprites[i].link < 0) {
+				releaseTexture(sff.sprites[i].texture_id);
+			}
+		}
 	}
 	// Clear vectors
 	sff.sprites.clear();
 	sff.palettes.clear();
+	sff.pixelOwners.clear();
+	sff.numDedupSprites = 0;
+	sff.dedupBytes = 0;
+	sff.file.close();
+	if (sff.pixelCacheBudget) {
+		trimPixelCache(sff.pixelCacheBudget);
+	}
+}
+
+// Re-reads a file that changed on disk. Sprites whose payload is unchanged keep
+// their texture, only new or edited ones are decoded again (lazy: on first
+// use). On error the sprites already loaded are left untouched.
+int reloadMugenSprite(Sff* sff) {
+	Sff next;
+	snprintf(next.filename, sizeof(next.filename), "%s", sff->filename);
+	next.useIndex = sff->useIndex;
+	next.hashPayloads = true;
+	if (!next.file.open(sff->filename)) {
+		printf("Error: can not open file %s\n", sff->filename);
+		return -1;
+	}
+	if (loadSffHeaders(&next, nullptr) != 0) {
+		for (Palette& p : next.palettes) {
+			releaseTexture(p.texture_id);
+		}
+		return -1;
+	}
+	if (sff->loader) {
+		// Sprites not uploaded yet are decoded below like changed ones
+		delete sff->loader;
+		sff->loader = nullptr;
+	}
+
+	// Textures of the current sprites by payload
+	std::vector<Sprite>& old = sff->sprites;
+	std::map<std::pair<uint64_t, int>, uint32_t> oldByPayload;
+	std::set<std::pair<uint64_t, int>> oldPayloads;
+	for (uint32_t i = 0; i < old.size(); i++) {
+		const Sprite& s = old[i];
+		if (s.data_len == 0 || !s.hash) {
+			continue;
+		}
+		oldPayloads.insert(std::make_pair(s.hash, s.rle));
+		bool resident = sff->lazy ? sff->cache.pos.count(i) > 0 : s.texture_id != 0;
+		if (resident) {
+			oldByPayload.emplace(std::make_pair(s.hash, s.rle), i);
+		}
+	}
+
+	std::map<GLuint, uint32_t> kept;	// texture -> first new sprite using it
+	std::vector<uint32_t> changed;
+	size_t numChanged = 0;			// payloads not in the previous file
+	for (uint32_t i = 0; i < next.sprites.size(); i++) {
+		Sprite& s = next.sprites[i];
+		if (s.link >= 0 || s.data_len == 0) {
+			continue;
+		}
+		auto it = oldByPayload.find(std::make_pair(s.hash, s.rle));
+		if (it != oldByPayload.end()) {
+			const Sprite& o = old[it->second];
+			// The file holds one reference per texture: further sprites with
+			// the same payload link to the first one. A lazy cache entry owns
+			// its texture, it can go to one sprite only.
+			auto k = kept.find(o.texture_id);
+			if (k == kept.end() || !sff->lazy) {
+				s.texture_id = o.texture_id;
+				s.Size[0] = o.Size[0];
+				s.Size[1] = o.Size[1];
+				copySpriteBounds(s, o);
+				if (k == kept.end()) {
+					kept.emplace(o.texture_id, i);
+				} else {
+					s.link = k->second;
+				}
+				continue;
+			}
+		}
+		if (oldPayloads.find(std::make_pair(s.hash, s.rle)) == oldPayloads.end()) {
+			numChanged++;
+		}
+		if (!sff->lazy) {
+			changed.push_back(i);
+		}
+	}
+
+	// Release textures no sprite uses anymore
+	std::map<uint64_t, uint32_t> owners;
+	if (sff->lazy) {
+		SpriteCache cache;
+		for (uint32_t idx : sff->cache.order) {
+			GLuint tex = old[idx].texture_id;
+			auto k = kept.find(tex);
+			if (k == kept.end()) {
+				glDeleteTextures(1, &tex);
+				continue;
+			}
+			cache.order.push_back(k->second);
+			cache.pos[k->second] = std::prev(cache.order.end());
+			cache.used += spriteTextureBytes(next.sprites[k->second]);
+		}
+		sff->cache.order.swap(cache.order);
+		sff->cache.pos.swap(cache.pos);
+		sff->cache.used = cache.used;
+	} else {
+		std::vector<GLuint> dropped;
+		for (const Sprite& s : old) {
+			if (s.texture_id && kept.find(s.texture_id) == kept.end()) {
+				dropped.push_back(s.texture_id);
+			}
+		}
+		std::sort(dropped.begin(), dropped.end());
+		dropped.erase(std::unique(dropped.begin(), dropped.end()), dropped.end());
+		for (GLuint tex : dropped) {
+			releaseTexture(tex);
+		}
+		for (const auto& p : sff->pixelOwners) {
+			auto k = kept.find(old[p.second].texture_id);
+			if (k != kept.end()) {
+				owners[p.first] = k->second;
+			}
+		}
+	}
+	for (Palette& p : sff->palettes) {
+		releaseTexture(p.texture_id);
+	}
+
+	sff->header = next.header;
+	sff->lofs = next.lofs;
+	sff->tofs = next.tofs;
+	sff->sprites.swap(next.sprites);
+	sff->palettes.swap(next.palettes);
+	sff->palette_usage.swap(next.palette_usage);
+	sff->compression_format_usage.swap(next.compression_format_usage);
+	sff->numLinkedSprites = next.numLinkedSprites;
+	sff->numDupPalettes = next.numDupPalettes;
+	sff->pixelOwners.swap(owners);
+	sff->file.swap(next.file);
+	sff->hashPayloads = true;
+	if (sff->lazy) {
+		printf("Reloaded %s: %zu of %u sprites changed\n", sff->filename, numChanged, sff->header.NumberOfSprites);
+		return 0;
+	}
+
+	if (!changed.empty()) {
+		SpriteDecodePool pool;
+		pool.start(sff, sff->numThreads);
+		for (uint32_t idx : changed) {
+			pool.push(idx);
+		}
+		pool.finish();
+		DecodedSprite d;
+		while (pool.pop(d)) {
+			if (!d.px) {
+				fprintf(stderr, "Error reading sprite %u\n", d.idx);
+				continue;
+			}
+			uploadDecodedSprite(sff, d);
+			pool.recycle(d);
+		}
+		trimPixelCacheAfterDecode(sff, 0);
+	}
+
+	// A changed sprite may have got a texture the file already holds from the
+	// pool: keep one reference and link it like a duplicate
+	std::map<GLuint, uint32_t> owner;
+	for (uint32_t i = 0; i < sff->header.NumberOfSprites; i++) {
+		Sprite& s = sff->sprites[i];
+		if (s.data_len > 0 && s.link < 0 && s.texture_id) {
+			auto r = owner.emplace(s.texture_id, i);
+			if (!r.second) {
+				releaseTexture(s.texture_id);
+				s.link = r.first->second;
+			}
+		}
+	}
+	sff->numDedupSprites = 0;
+	sff->dedupBytes = 0;
+	for (uint32_t i = 0; i < sff->header.NumberOfSprites; i++) {
+		Sprite& s = sff->sprites[i];
+		if (s.data_len > 0 && s.link >= 0) {
+			s.link = owner.count(s.texture_id) ? owner[s.texture_id] : s.link;
+			sff->numDedupSprites++;
+			sff->dedupBytes += spriteTextureBytes(s);
+		}
+	}
+	for (uint32_t i = 0; i < sff->header.NumberOfSprites; i++) {
+		Sprite& s = sff->sprites[i];
+		if (s.link >= 0 && s.data_len == 0) {
+			s.texture_id = sff->sprites[s.link].texture_id;
+			s.Size[0] = sff->sprites[s.link].Size[0];
+			s.Size[1] = sff->sprites[s.link].Size[1];
+			copySpriteBounds(s, sff->sprites[s.link]);
+		}
+	}
+	sff->file.close();
+	printf("Reloaded %s: %zu of %u sprites changed\n", sff->filename, numChanged, sff->header.NumberOfSprites);
+	return 0;
 }
 
 int exportRGBASpriteAsPng(Sprite& s, const char* filename) {
@@ -1032,8 +2581,7 @@ int exportRGBASpriteAsPng(Sprite& s, const char* filename) {
 		return -1;
 	}
 
-	LodePNGState state;
-	lodepng_state_init(&state);
+	LodePNGState& state = pngEncodeState();
 
 	// Print sprite  information
 	// printf("Group:%d,%d size=%ux%u Offset=%u,%u coldepth=%d rle=%d\n", s.Group, s.Number, s.Size[0], s.Size[1], s.Offset[0], s.Offset[1], s.coldepth, s.rle);
@@ -1062,8 +2610,7 @@ int exportRGBASpriteAsPng(Sprite& s, const char* filename) {
 	} else {
 		fprintf(stderr, "Error encoding PNG data: %s\n", lodepng_error_text(err_code));
 	}
-	lodepng_state_cleanup(&state);
-	if (png) free(png);
+	lodepng_free(png);
 	return err_code;
 }
 
@@ -1073,8 +2620,7 @@ int exportPalettedSpriteAsPng(Sprite& s, GLuint pal_texture_id, const char* file
 		return -1;
 	}
 
-	LodePNGState state;
-	lodepng_state_init(&state);
+	LodePNGState& state = pngEncodeState();
 	// Set color type to palette
 	state.info_raw.colortype = LCT_PALETTE;
 	state.info_raw.bitdepth = 8;
@@ -1110,7 +2656,6 @@ int exportPalettedSpriteAsPng(Sprite& s, GLuint pal_texture_id, const char* file
 	} else {
 		fprintf(stderr, "Error encoding PNG data: %s\n", lodepng_error_text(err_code));
 	}
-	lodepng_state_cleanup(&state);
-	free(png);
+	lodepng_free(png);
 	return err_code;
 }
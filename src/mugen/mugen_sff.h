@@ -3,21 +3,35 @@
 // C headers
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
 // C++ headers
 #include <map>
+#include <set>
+#include <list>
 #include <vector>
 #include <array>
 #include <string>
 #include <algorithm>
 #include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <chrono>
 
 #ifdef _WIN32
 #include <windows.h>
 #else
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #endif
 
 #include "lodepng.h"
@@ -41,6 +55,46 @@ typedef struct {
 	uint32_t NumberOfPalettes;
 } SffHeader;
 
+// On-disk header records (little-endian, packed), decoded in bulk from the
+// mapped header tables
+typedef struct __attribute__((packed)) {
+	uint32_t NextSubheader;
+	uint32_t Size;
+	int16_t Offset[2];
+	uint16_t Group;
+	uint16_t Number;
+	uint16_t Link;
+	uint8_t SamePalette;
+	uint8_t Blank[13];
+} SpriteHeaderV1;
+
+typedef struct __attribute__((packed)) {
+	uint16_t Group;
+	uint16_t Number;
+	uint16_t Size[2];
+	int16_t Offset[2];
+	uint16_t Link;
+	uint8_t Format;
+	uint8_t ColorDepth;
+	uint32_t DataOffset;
+	uint32_t DataSize;
+	uint16_t PaletteIndex;
+	uint16_t Flags;		// bit 0: data is in tdata (tofs) instead of ldata (lofs)
+} SpriteHeaderV2;
+
+typedef struct __attribute__((packed)) {
+	int16_t Group;
+	int16_t Number;
+	int16_t NumColors;
+	uint16_t Link;
+	uint32_t DataOffset;
+	uint32_t DataSize;
+} PaletteHeaderV2;
+
+static_assert(sizeof(SpriteHeaderV1) == 32, "SFF v1 subheader is 32 bytes");
+static_assert(sizeof(SpriteHeaderV2) == 28, "SFF v2 sprite header is 28 bytes");
+static_assert(sizeof(PaletteHeaderV2) == 16, "SFF v2 palette header is 16 bytes");
+
 class Sprite {
 public:
 	uint16_t Group;
@@ -52,6 +106,12 @@ public:
 	uint8_t coldepth;
 	unsigned int texture_id;
 	size_t atlas_x, atlas_y;
+	uint32_t data_ofs = 0;	// payload position in file (v1: PCX header, v2: compressed data)
+	uint32_t data_len = 0;	// payload length, 0 if the sprite has no pixel data of its own
+	int link = -1;			// index of the sprite whose pixels are shared, -1 if none
+	uint64_t hash = 0;		// hash of the payload bytes, 0 if not computed
+	uint16_t Bounds[4] = { 0, 0, 0, 0 };	// x, y, w, h of the non-transparent pixels, w = 0 if none
+	bool hasBounds = false;	// Bounds set by the last decode
 
 	// Constructor!
 	Sprite(uint16_t group, uint16_t number,
@@ -66,11 +126,13 @@ public:
 		Offset[0] = offset_x;
 		Offset[1] = offset_y;
 	}
+	Sprite() : Sprite(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0) {}
 };
 
 class Palette {
 public:
 	unsigned int texture_id;
+	uint32_t data_ofs = 0;	// position of the colors in the SFF (v1: 256 RGB, v2: 256 RGBA)
 
 	// Constructor
 	Palette(unsigned int id) : texture_id(id) {}
@@ -112,6 +174,263 @@ public:
 	}
 };
 
+// Read-only view of a whole file. Memory-mapped when the platform allows it,
+// otherwise the file is read into a heap buffer with a single fread.
+class MappedFile {
+public:
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() { close(); }
+
+	bool open(const char* filename) {
+		close();
+#ifdef _WIN32
+		hFile = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER fsize;
+		if (GetFileSizeEx(hFile, &fsize) && fsize.QuadPart > 0) {
+			hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (hMapping) {
+				ptr = (uint8_t*) MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+			}
+			if (ptr) {
+				len = (size_t) fsize.QuadPart;
+				mapped = true;
+				return true;
+			}
+		}
+		close();
+#else
+		int fd = ::open(filename, O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void* p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				::close(fd);
+				ptr = (uint8_t*) p;
+				len = (size_t) st.st_size;
+				mapped = true;
+				return true;
+			}
+		}
+		::close(fd);
+#endif
+		return readWhole(filename);
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (mapped && ptr) UnmapViewOfFile(ptr);
+		if (hMapping) CloseHandle(hMapping);
+		if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+		hMapping = NULL;
+		hFile = INVALID_HANDLE_VALUE;
+#else
+		if (mapped && ptr) munmap(ptr, len);
+#endif
+		if (!mapped && ptr) free(ptr);
+		ptr = nullptr;
+		len = 0;
+		mapped = false;
+	}
+
+	// Hint the OS to start reading [offset, offset + length) in background
+	void prefetch(size_t offset, size_t length) const {
+#ifndef _WIN32
+		if (!mapped || offset >= len) return;
+		size_t page = (size_t) sysconf(_SC_PAGESIZE);
+		size_t start = offset & ~(page - 1);
+		if (length > len - start) length = len - start;
+		madvise(ptr + start, length, MADV_WILLNEED);
+#endif
+	}
+
+	const uint8_t* data() const { return ptr; }
+	size_t size() const { return len; }
+	bool isMapped() const { return mapped; }
+
+	// Takes ownership of a malloc'ed buffer holding the whole file
+	void adopt(uint8_t* buf, size_t size) {
+		close();
+		ptr = buf;
+		len = size;
+	}
+
+	void swap(MappedFile& other) {
+		std::swap(ptr, other.ptr);
+		std::swap(len, other.len);
+		std::swap(mapped, other.mapped);
+#ifdef _WIN32
+		std::swap(hFile, other.hFile);
+		std::swap(hMapping, other.hMapping);
+#endif
+	}
+
+private:
+	// Fallback when mapping is not possible (empty file, pipe, exotic filesystem)
+	bool readWhole(const char* filename) {
+		FILE* file = fopen(filename, "rb");
+		if (!file) {
+			return false;
+		}
+		fseek(file, 0, SEEK_END);
+		long fsize = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		if (fsize <= 0) {
+			fclose(file);
+			return false;
+		}
+		ptr = (uint8_t*) malloc(fsize);
+		if (!ptr || fread(ptr, fsize, 1, file) != 1) {
+			free(ptr);
+			ptr = nullptr;
+			fclose(file);
+			return false;
+		}
+		fclose(file);
+		len = (size_t) fsize;
+		return true;
+	}
+
+	uint8_t* ptr = nullptr;
+	size_t len = 0;
+	bool mapped = false;
+#ifdef _WIN32
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	HANDLE hMapping = NULL;
+#endif
+};
+
+// Reports writes to one file: inotify on Linux, polling of size and mtime
+// elsewhere. The directory is watched so that editors saving through a
+// temporary file and a rename are noticed too.
+class FileWatcher {
+public:
+	FileWatcher() {}
+	FileWatcher(const FileWatcher&) = delete;
+	FileWatcher& operator=(const FileWatcher&) = delete;
+	~FileWatcher() { stop(); }
+
+	bool start(const char* filename);
+	void stop();
+	bool changed();		// does not wait, true if the file was written since the last call
+
+private:
+#ifdef __linux__
+	int fd = -1;
+	std::string name;
+#else
+	std::string path;
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	std::chrono::steady_clock::time_point lastPoll;
+#endif
+};
+
+// Reads many whole files with lots of reads in flight, for batch jobs over
+// thousands of SFF. Uses io_uring on Linux when the kernel allows it, otherwise
+// plain reads on a few threads. Files complete in any order.
+struct UringQueue;
+class SffBatchReader {
+public:
+	SffBatchReader() {}
+	SffBatchReader(const SffBatchReader&) = delete;
+	SffBatchReader& operator=(const SffBatchReader&) = delete;
+	~SffBatchReader() { stop(); }
+
+	void start(const std::vector<std::string>& filenames, unsigned depth);	// depth = reads in flight
+	int next(MappedFile& file);		// waits for a file, returns its position in filenames, -1 when all are done
+	void stop();
+	bool usingUring() const { return uring != nullptr; }
+
+private:
+	typedef struct {
+		uint8_t* buf;
+		size_t size;
+		size_t queued;		// bytes for which a read was submitted
+		size_t done;
+		int fd;
+		int inFlight;
+		bool failed;
+	} BatchFile;
+
+	typedef struct {
+		uint32_t file;
+		uint32_t len;
+		uint64_t ofs;
+	} BatchRead;
+
+	bool fillRing();
+	void reapRing();
+	void submitRead(uint32_t slot);
+	void endRead(uint32_t file);
+	void failFile(uint32_t file);
+	void readerThread();
+
+	std::vector<std::string> names;
+	std::vector<BatchFile> files;
+	size_t numReturned = 0;
+	std::deque<uint32_t> ready;		// read (or failed) files not returned yet
+
+	// io_uring
+	UringQueue* uring = nullptr;
+	std::vector<BatchRead> reads;	// one per ring entry
+#ifdef __linux__
+	std::vector<struct iovec> iovecs;
+#endif
+	std::vector<uint32_t> freeReads;
+	std::deque<uint32_t> retries;	// reads to submit again after a short read
+	size_t nextOpen = 0;
+	uint32_t toSubmit = 0;
+	int numInFlight = 0;
+
+	// Fallback
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::atomic<size_t> nextRead{ 0 };
+	std::atomic<bool> quit{ false };
+};
+
+// Resident sprite textures in lazy mode, least recently used are evicted first
+typedef struct {
+	size_t budget = 256 * 1024 * 1024;	// bytes of sprite textures kept on GPU, 0 = unlimited
+	size_t used = 0;
+	std::list<uint32_t> order;			// sprite index, front = most recently used
+	std::map<uint32_t, std::list<uint32_t>::iterator> pos;
+} SpriteCache;
+
+// Textures shared by all open Sff, keyed by content hash (sprite pixels or
+// palette colors). Only used from the GL thread.
+typedef struct {
+	GLuint texture_id;
+	size_t bytes;
+	int refs;
+	uint64_t layout;	// size and format (pixelLayout), checked on every match
+} PooledTexture;
+
+typedef struct {
+	std::map<uint64_t, PooledTexture> byKey;
+	std::map<GLuint, uint64_t> keyOf;
+	size_t bytes = 0;			// GPU memory of all pooled textures
+} TexturePool;
+
+class SpriteDecodePool;
+
+// PNG sprites decoded by a SpriteDecodePool
+typedef struct {
+	size_t sprites;
+	uint64_t bytesIn;		// compressed payloads
+	uint64_t pixelsOut;
+	double seconds;			// from the first PNG sprite started to the last one decoded
+} PngBatchStats;
+
 typedef struct {
 	char filename[256];
 	SffHeader header;
@@ -120,8 +439,104 @@ typedef struct {
 	std::map<int, int> palette_usage;
 	std::map<int, int> compression_format_usage;
 	size_t numLinkedSprites;
+	size_t numDupPalettes = 0;	// palettes of the file merged into an identical one
+	bool lazy = false;		// decode and upload sprites on first use instead of at load time
+	unsigned numThreads = 0;	// sprite decode workers, 0 = one per CPU core
+	bool progressive = false;	// return after the headers, sprites are streamed in by uploadLoadedSprites
+	SpriteDecodePool* loader = nullptr;	// background decoder of a progressive load
+	size_t numLoaded = 0;		// sprites uploaded so far by a progressive load
+	bool useIndex = false;		// read/write the .sffidx header index in the cache directory
+	size_t pixelCacheBudget = 0;	// disk cache of decoded PNG sprites in bytes, 0 = disabled
+	bool hashPayloads = false;	// fill Sprite::hash while parsing, reloadMugenSprite diffs with it
+	bool headless = false;		// readSffHeaders creates no GL texture (catalog, benchmarks)
+	std::map<uint64_t, uint32_t> pixelOwners;	// decoded pixel hash -> sprite owning the texture
+	size_t numDedupSprites = 0;	// sprites sharing a texture because their pixels are identical
+	size_t dedupBytes = 0;		// texture memory saved by those
+	PngBatchStats pngStats = {};	// PNG decoding of the last load
+	MappedFile file;		// kept open while lazy, payloads are decoded from it
+	uint32_t lofs, tofs;
+	SpriteCache cache;
 } Sff;
 
+// Memory a decoder writes into, len bytes at data
+typedef struct {
+	uint8_t* data;
+	size_t len;
+} PixelSpan;
+
+// Decode output reused from sprite to sprite. It grows to the largest sprite
+// seen and is freed by its owner, not after each upload.
+typedef struct {
+	uint8_t* data;
+	size_t cap;
+} PixelBuffer;
+
+// Decoded pixels of one sprite, waiting to be uploaded on the GL thread
+typedef struct {
+	uint32_t idx;
+	uint8_t* px;		// buffer of the pool, NULL if decoding failed
+	size_t cap;			// capacity of px, handed back with recycle()
+	uint16_t Size[2];	// decoded size (PNG may differ from the header)
+	uint16_t Bounds[4];	// box of the non-transparent pixels (Sprite::Bounds)
+	bool hasBounds;		// Sprite::hasBounds
+	uint64_t hash;		// hash of the decoded pixels and their layout
+} DecodedSprite;
+
+// Decodes the sprites of an Sff on worker threads. Results come back in the
+// order the sprites were pushed, so textures are created only on the thread
+// owning the GL context, in sprite order. The Sff file must stay mapped until
+// stop() returns.
+//
+// PNG sprites are held back until finish(), then sorted largest payload first
+// and dealt to per-worker queues. A worker out of work steals the largest
+// sprite left in the other queues.
+class SpriteDecodePool {
+public:
+	SpriteDecodePool() {}
+	SpriteDecodePool(const SpriteDecodePool&) = delete;
+	SpriteDecodePool& operator=(const SpriteDecodePool&) = delete;
+	~SpriteDecodePool() { stop(); }
+
+	void start(Sff* sff, unsigned numThreads);
+	void push(uint32_t idx);			// queue a sprite for decoding, its header must be complete
+	void finish();						// no more sprites will be pushed
+	bool done();						// finished and every pushed sprite delivered
+	bool pop(DecodedSprite& out);		// waits for the next sprite, false once all are delivered
+	bool tryPop(DecodedSprite& out);	// does not wait, false if nothing is ready yet
+	void recycle(DecodedSprite& d);		// gives the pixels back once uploaded
+	void stop();						// cancels pending work and joins the workers
+	PngBatchStats pngStats();			// PNG sprites decoded so far
+
+private:
+	void worker(unsigned self);
+	bool canTake();
+	size_t take(unsigned self);
+	bool nextReady();
+	DecodedSprite popNext();
+
+	Sff* sff = nullptr;
+	std::vector<uint32_t> work;			// sprites with their own pixel data, in push order
+	std::vector<uint8_t> workState;		// SLOT_HELD / SLOT_QUEUED / SLOT_TAKEN, per work position
+	std::vector<size_t> plain;			// positions of non-PNG sprites, decoded in order
+	size_t nextPlain = 0;
+	std::vector<size_t> held;			// positions of PNG sprites until finish()
+	std::vector<std::deque<size_t>> queues;	// PNG positions of each worker, largest first
+	size_t numQueued = 0;				// queued positions not taken yet
+	size_t numTaken = 0;
+	std::vector<std::thread> threads;
+	std::mutex mtx;
+	std::condition_variable hasWork, notEmpty;
+	std::map<size_t, DecodedSprite> ready;	// decoded, by work position
+	std::vector<PixelBuffer> spare;		// recycled outputs, freed by stop()
+	size_t maxReady = 256;				// sprites taken but not delivered
+	unsigned running = 0;
+	bool cancel = false;
+	bool closed = false;
+	size_t numDelivered = 0;
+	PngBatchStats png = {};
+	std::chrono::steady_clock::time_point pngFirst, pngLast;
+};
+
 typedef struct {
 	uint16_t width, height;
 	struct stbrp_rect* rects;
@@ -180,12 +595,132 @@ int readSffHeader(Sff* sff, FILE* file, uint32_t* lofs, uint32_t* tofs);
 int readSpriteHeaderV1(Sprite* sprite, FILE* file, uint32_t* ofs, uint32_t* size, uint16_t* link);
 int readSpriteHeaderV2(Sprite* sprite, FILE* file, uint32_t* ofs, uint32_t* size, uint32_t lofs, uint32_t tofs, uint16_t* link);
 uint8_t* readSpriteDataV1(Sprite* sprite, FILE* file, Sff* sff, uint64_t offset, uint32_t datasize, uint32_t nextSubheader, Sprite* prev, bool c00);
-uint8_t* readSpriteDataV2(Sprite* sprite, FILE* file, uint64_t offset, uint32_t datasize, Sff* sff);
+uint8_t* readSpriteDataV2(Sprite& s, FILE* file, uint64_t offset, uint32_t datasize);
+
+// Load Sprite from memory (whole file mapped by MappedFile)
+uint32_t readSffHeader(Sff* sff, const uint8_t* data, size_t size, uint32_t* lofs, uint32_t* tofs);
+int readSpriteHeaderV1(Sprite& sprite, const uint8_t* data, size_t filesize, uint64_t shofs, uint32_t* ofs, uint32_t* size, uint16_t* link);
+int readSpriteHeaderV2(Sprite& sprite, const uint8_t* data, size_t filesize, uint64_t shofs, uint32_t* ofs, uint32_t* size, uint32_t lofs, uint32_t tofs, uint16_t* link);
+void decodeSpriteHeadersV2(const SpriteHeaderV2* table, uint32_t count, uint32_t lofs, uint32_t tofs, Sprite* sprites, uint16_t* links);
+int readSpriteDataV1(Sprite& s, const uint8_t* data, size_t filesize, uint64_t offset, uint32_t datasize, PixelSpan dst);
+int readSpriteDataV2(Sprite& s, const uint8_t* data, size_t filesize, uint64_t offset, uint32_t datasize, PixelSpan dst);
+int readSffHeaders(Sff* sff, SpriteDecodePool* pipeline);
+size_t spriteDecodeBytes(Sff* sff, const Sprite& s);
+int decodeSpriteInto(Sff* sff, Sprite& s, PixelSpan dst);
+uint8_t* decodeSprite(Sff* sff, Sprite& s, PixelBuffer& buf);
+bool reservePixels(PixelBuffer& buf, size_t len);
+void spriteBounds(Sprite& s, const uint8_t* px, size_t len);
+
+// PngDecode paths, each one adds to the previous
+#define PNG_LODEPNG	0	// lodepng alone
+#define PNG_INFLATE	1	// lodepng with sffZlibDecompress as its inflate
+#define PNG_DIRECT	2	// 8-bit paletted PNG10 unfiltered straight into the span
+
+// Sprite decoders. Source is read-only (may point straight into a mapped file),
+// pixels go to the caller's span. Return 0, or -1 if the span is too small
+// or the data can not be decoded.
+int RlePcxDecode(Sprite& s, const uint8_t* srcPx, size_t srcLen, uint16_t bpl, PixelSpan dst);
+int Rle8Decode(Sprite& s, const uint8_t* srcPx, size_t srcLen, PixelSpan dst);
+int Rle5Decode(Sprite& s, const uint8_t* srcPx, size_t srcLen, PixelSpan dst);
+int Lz5Decode(Sprite& s, const uint8_t* srcPx, size_t srcLen, PixelSpan dst);
+int PngDecode(Sprite& s, const uint8_t* data, size_t datasize, PixelSpan dst, int path = PNG_DIRECT);
+size_t pngDecodeBytes(const Sprite& s, const uint8_t* data, size_t datasize);
+
+// Decoders of one format that give the same pixels, compared by the benchmarks
+typedef struct {
+	const char* name;
+	void (*decode)(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen);
+} DecodeKernel;
+
+// RLE8 kernels (mugen_sff_simd.cpp)
+void rle8DecodeReference(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen);
+void rle8DecodeScalar(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen);
+std::vector<DecodeKernel> rle8Kernels();
+
+// Palette expansion to RGBA (mugen_sff_simd.cpp)
+typedef struct {
+	const char* name;
+	void (*expand)(const uint8_t* px, size_t n, const uint32_t* pal_rgba, uint32_t* rgba);
+} PaletteKernel;
+
+void expandPaletteReference(const uint8_t* px, size_t n, const uint32_t* pal_rgba, uint32_t* rgba);
+void expandPaletteScalar(const uint8_t* px, size_t n, const uint32_t* pal_rgba, uint32_t* rgba);
+std::vector<PaletteKernel> paletteKernels();
+void expandPalette(const uint8_t* px, size_t n, const uint32_t* pal_rgba, uint32_t* rgba);
+int expandSpritePalette(const Sprite& s, const uint8_t* px, const uint32_t pal_rgba[256], uint32_t* rgba);
+
+// RLE5: byte loop and the table driven decoder used by Rle5Decode
+void rle5DecodeReference(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen);
+void rle5DecodeTable(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen);
+
+// LZ5: byte loop and the wide copy decoder used by Lz5Decode
+void lz5DecodeReference(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen);
+void lz5DecodeFast(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen);
+
+// zlib decoder for lodepng's custom_zlib hook (mugen_sff_inflate.cpp)
+unsigned sffZlibDecompress(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize, const LodePNGDecompressSettings* settings);
+
+// lodepng allocators, pooled per thread (mugen_sff_alloc.cpp). Memory lodepng
+// returns (decoded images, encoded PNGs) must be freed with lodepng_free.
+void* lodepng_malloc(size_t size);
+void* lodepng_realloc(void* ptr, size_t new_size);
+void lodepng_free(void* ptr);
+LodePNGState& pngDecodeState();
+LodePNGState& pngEncodeState();
+
+typedef struct {
+	uint64_t calls;		// lodepng_malloc/lodepng_realloc calls
+	uint64_t mallocs;	// those that had to call malloc
+} PngAllocStats;
+
+PngAllocStats pngAllocStats();
+void setPngPool(bool enabled);
 
 void spriteCopy(Sprite* dst, const Sprite* src);
 void printSprite(Sprite* sprite);
 int loadMugenSprite(const char* filename, Sff* sff);
 void deleteMugenSprite(Sff& sff);
+int reloadMugenSprite(Sff* sff);
+const TexturePool& texturePool();
+GLuint acquirePooledTexture(uint64_t key, uint64_t layout);
+void addPooledTexture(uint64_t key, uint64_t layout, GLuint texture_id, size_t bytes);
+void releaseTexture(GLuint texture_id);
+int pooledTextureRefs(GLuint texture_id);
+GLuint sharedPaletteTexture(const uint8_t* pal, bool rgb);
+size_t sffTextureBytes(const Sff& sff, size_t* shared);
+GLuint getSpriteTexture(Sff& sff, size_t idx);
+uint64_t hashBytes(const void* data, size_t len, uint64_t seed);
+GLuint generateTextureFromPaletteRGBA(uint32_t pal_rgba[256]);
+GLuint generateTextureFromPaletteRGB(rgb_t pal_rgb[256]);
+
+
+// Header index sidecar (mugen_sff_index.cpp)
+std::string sffCacheDir(const char* subdir);
+std::string sffIndexPath(const char* filename);
+int readSffIndex(Sff* sff, SpriteDecodePool* pipeline);
+int writeSffIndex(Sff* sff);
+
+// Decoded pixel cache (mugen_sff_cache.cpp)
+int readCachedPixels(Sprite& s, uint64_t hash, PixelSpan dst);
+int writeCachedPixels(const Sprite& s, uint64_t hash, const uint8_t* px);
+void trimPixelCache(size_t budget);
+void trimPixelCacheWrites(size_t budget, size_t slack);
+
+// Header catalog of a directory tree (mugen_sff_catalog.cpp)
+int buildSffCatalog(const char* root, const char* catalogPath, unsigned numThreads);
+bool isSffFilename(const std::string& path);
+
+// Batch reads (mugen_sff_batch.cpp)
+std::vector<std::string> listSffFiles(const char* root);
+int benchmarkBatchRead(const char* root, unsigned depth);
+
+// Decoder benchmarks (mugen_sff_bench.cpp)
+int benchmarkDecoders(const std::vector<const char*>& filenames);
+
+bool uploadLoadedSprites(Sff& sff, double budget_ms);
+size_t spriteTextureBytes(const Sprite& s);
+uint64_t pixelLayout(const Sprite& s);
+uint64_t pixelHash(const Sprite& s, const uint8_t* px);
 int exportPalettedSpriteAsPng(Sprite& s, GLuint pal_texture_id, const char* filename);
 int exportRGBASpriteAsPng(Sprite& s, const char* filename);
 
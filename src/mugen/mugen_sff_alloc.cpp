@@ -0,0 +1,149 @@
+#include "mugen_sff.h"
+
+// lodepng allocators (lodepng.cpp is built with LODEPNG_NO_COMPILE_ALLOCATORS)
+//
+// Decoding or encoding one PNG makes lodepng allocate and free a dozen
+// buffers (chunk data, inflate output, scanlines, palettes). Freed blocks are
+// kept by the thread in lists of power of two sizes and handed out again, so
+// after the first few sprites a thread no longer calls malloc for them. Each
+// block starts with a header giving its size, any thread may free it.
+
+#define PNG_POOL_MIN		64					// smallest block size
+#define PNG_POOL_CLASSES	23					// block sizes 64 << k, up to 256 MB
+#define PNG_POOL_KEEP		8					// free blocks kept per size
+#define PNG_POOL_KEEP_BYTES	(64 * 1024 * 1024)	// free memory kept per thread
+#define PNG_POOL_DIRECT		PNG_POOL_CLASSES	// class of blocks straight from malloc
+
+typedef struct {
+	size_t cap;		// usable bytes after the header
+	size_t cls;		// size class, PNG_POOL_DIRECT if not pooled
+} PngBlock;
+
+static std::atomic<uint64_t> allocCalls(0), allocMallocs(0);
+static std::atomic<bool> poolEnabled(true);
+
+// Thread's free blocks, and the lodepng states its decodes and exports reuse
+typedef struct PngThreadPool {
+	std::vector<PngBlock*> blocks[PNG_POOL_CLASSES];
+	size_t bytes = 0;
+	LodePNGState decoder, encoder;
+	PngThreadPool() {
+		lodepng_state_init(&decoder);
+		lodepng_state_init(&encoder);
+	}
+	~PngThreadPool();
+} PngThreadPool;
+
+// Set while the thread's pool is being destroyed, later frees go to free()
+static thread_local bool poolGone = false;
+
+static PngThreadPool& threadPool() {
+	static thread_local PngThreadPool pool;
+	return pool;
+}
+
+PngThreadPool::~PngThreadPool() {
+	lodepng_state_cleanup(&decoder);
+	lodepng_state_cleanup(&encoder);
+	poolGone = true;
+	for (auto& list : blocks) {
+		for (PngBlock* b : list) {
+			free(b);
+		}
+	}
+}
+
+static inline void* blockData(PngBlock* b) {
+	return (uint8_t*) b + sizeof(PngBlock);
+}
+
+static inline PngBlock* blockOf(void* ptr) {
+	return (PngBlock*) ((uint8_t*) ptr - sizeof(PngBlock));
+}
+
+void* lodepng_malloc(size_t size) {
+	allocCalls.fetch_add(1, std::memory_order_relaxed);
+	size_t cls = 0;
+	while (cls < PNG_POOL_CLASSES && ((size_t) PNG_POOL_MIN << cls) < size) {
+		cls++;
+	}
+	if (cls == PNG_POOL_CLASSES || poolGone || !poolEnabled.load(std::memory_order_relaxed)) {
+		cls = PNG_POOL_DIRECT;
+	} else {
+		std::vector<PngBlock*>& list = threadPool().blocks[cls];
+		if (!list.empty()) {
+			PngBlock* b = list.back();
+			list.pop_back();
+			threadPool().bytes -= b->cap;
+			return blockData(b);
+		}
+	}
+	size_t cap = cls == PNG_POOL_DIRECT ? size : (size_t) PNG_POOL_MIN << cls;
+	allocMallocs.fetch_add(1, std::memory_order_relaxed);
+	PngBlock* b = (PngBlock*) malloc(sizeof(PngBlock) + cap);
+	if (!b) {
+		return NULL;
+	}
+	b->cap = cap;
+	b->cls = cls;
+	return blockData(b);
+}
+
+void lodepng_free(void* ptr) {
+	if (!ptr) {
+		return;
+	}
+	PngBlock* b = blockOf(ptr);
+	if (b->cls != PNG_POOL_DIRECT && !poolGone) {
+		PngThreadPool& pool = threadPool();
+		std::vector<PngBlock*>& list = pool.blocks[b->cls];
+		if (list.size() < PNG_POOL_KEEP && pool.bytes + b->cap <= PNG_POOL_KEEP_BYTES) {
+			list.push_back(b);
+			pool.bytes += b->cap;
+			return;
+		}
+	}
+	free(b);
+}
+
+// Like realloc, NULL leaves the block untouched
+void* lodepng_realloc(void* ptr, size_t new_size) {
+	if (!ptr) {
+		return lodepng_malloc(new_size);
+	}
+	PngBlock* b = blockOf(ptr);
+	if (new_size <= b->cap) {
+		allocCalls.fetch_add(1, std::memory_order_relaxed);
+		return ptr;
+	}
+	void* grown = lodepng_malloc(new_size);
+	if (!grown) {
+		return NULL;
+	}
+	memcpy(grown, ptr, b->cap);
+	lodepng_free(ptr);
+	return grown;
+}
+
+// Decoder state of the thread. lodepng_inspect resets what the last PNG left
+// in info_png, callers set info_raw and the decoder settings every time.
+LodePNGState& pngDecodeState() {
+	return threadPool().decoder;
+}
+
+// Encoder state of the thread, palettes cleared
+LodePNGState& pngEncodeState() {
+	LodePNGState& state = threadPool().encoder;
+	lodepng_palette_clear(&state.info_raw);
+	lodepng_palette_clear(&state.info_png.color);
+	return state;
+}
+
+PngAllocStats pngAllocStats() {
+	return { allocCalls.load(), allocMallocs.load() };
+}
+
+// Off, every lodepng allocation goes to malloc (to compare in benchmarks)
+void setPngPool(bool enabled) {
+	poolEnabled = enabled;
+}
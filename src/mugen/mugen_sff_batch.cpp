@@ -0,0 +1,498 @@
+#include "mugen_sff.h"
+#include <filesystem>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+// Batch reads
+//
+// Whole files are read into heap buffers that MappedFile adopts, so a batch job
+// hands them to loadMugenSprite or readSffHeaders like any opened file.
+// With io_uring each file is split in BATCH_CHUNK reads and up to depth reads
+// of many files are in flight at once. Opening a file stays a blocking call.
+// Without io_uring (old kernel, seccomp, other OS) a few threads read one file
+// at a time each.
+
+#define BATCH_CHUNK (256 * 1024)
+#define BATCH_MAX_THREADS 16
+
+#ifdef __linux__
+// Minimal io_uring: the kernel headers are enough, no liburing needed
+struct UringQueue {
+	int fd = -1;
+	unsigned entries = 0;
+	uint8_t* sqRing = nullptr;
+	uint8_t* cqRing = nullptr;
+	size_t sqRingSize = 0, cqRingSize = 0;
+	struct io_uring_sqe* sqes = nullptr;
+	unsigned *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe* cqes;
+};
+
+static void closeUring(UringQueue* q) {
+	if (q->sqes) munmap(q->sqes, q->entries * sizeof(struct io_uring_sqe));
+	if (q->cqRing && q->cqRing != q->sqRing) munmap(q->cqRing, q->cqRingSize);
+	if (q->sqRing) munmap(q->sqRing, q->sqRingSize);
+	if (q->fd >= 0) ::close(q->fd);
+	delete q;
+}
+
+static UringQueue* openUring(unsigned depth) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	UringQueue* q = new UringQueue();
+	q->fd = (int) syscall(__NR_io_uring_setup, depth, &p);
+	if (q->fd < 0) {
+		delete q;
+		return nullptr;
+	}
+	q->entries = p.sq_entries;
+	q->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	q->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single) {
+		q->sqRingSize = q->cqRingSize = std::max(q->sqRingSize, q->cqRingSize);
+	}
+	void* sq = mmap(NULL, q->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		closeUring(q);
+		return nullptr;
+	}
+	q->sqRing = (uint8_t*) sq;
+	if (single) {
+		q->cqRing = q->sqRing;
+	} else {
+		void* cq = mmap(NULL, q->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			closeUring(q);
+			return nullptr;
+		}
+		q->cqRing = (uint8_t*) cq;
+	}
+	void* sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		closeUring(q);
+		return nullptr;
+	}
+	q->sqes = (struct io_uring_sqe*) sqes;
+	q->sqTail = (unsigned*) (q->sqRing + p.sq_off.tail);
+	q->sqMask = (unsigned*) (q->sqRing + p.sq_off.ring_mask);
+	q->sqArray = (unsigned*) (q->sqRing + p.sq_off.array);
+	q->cqHead = (unsigned*) (q->cqRing + p.cq_off.head);
+	q->cqTail = (unsigned*) (q->cqRing + p.cq_off.tail);
+	q->cqMask = (unsigned*) (q->cqRing + p.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe*) (q->cqRing + p.cq_off.cqes);
+	return q;
+}
+
+// Submits the queued entries and waits for at least minComplete completions
+static int enterUring(UringQueue* q, unsigned toSubmit, unsigned minComplete) {
+	int rc;
+	do {
+		rc = (int) syscall(__NR_io_uring_enter, q->fd, toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+	return rc;
+}
+#else
+struct UringQueue {};
+static void closeUring(UringQueue* q) { delete q; }
+#endif
+
+// Fallback: the whole file with as few calls as possible
+static bool readWholeFile(const char* filename, uint8_t** buf, size_t* size) {
+	*buf = nullptr;
+	*size = 0;
+#ifdef _WIN32
+	FILE* file = fopen(filename, "rb");
+	if (!file) {
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long fsize = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	uint8_t* p = fsize > 0 ? (uint8_t*) malloc(fsize) : nullptr;
+	bool ok = p && fread(p, fsize, 1, file) == 1;
+	fclose(file);
+	if (!ok) {
+		free(p);
+		return false;
+	}
+	*buf = p;
+	*size = (size_t) fsize;
+	return true;
+#else
+	int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	uint8_t* p = nullptr;
+	size_t done = 0;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && (p = (uint8_t*) malloc(st.st_size))) {
+		while (done < (size_t) st.st_size) {
+			ssize_t n = pread(fd, p + done, st.st_size - done, done);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) break;
+			done += n;
+		}
+	}
+	::close(fd);
+	if (!p || done != (size_t) st.st_size) {
+		free(p);
+		return false;
+	}
+	*buf = p;
+	*size = done;
+	return true;
+#endif
+}
+
+void SffBatchReader::start(const std::vector<std::string>& filenames, unsigned depth) {
+	stop();
+	names = filenames;
+	files.assign(names.size(), BatchFile{ nullptr, 0, 0, 0, -1, 0, false });
+	numReturned = 0;
+	if (depth == 0) {
+		depth = 1;
+	}
+#ifdef __linux__
+	uring = openUring(depth);
+	if (uring) {
+		reads.resize(uring->entries);
+		iovecs.resize(uring->entries);
+		freeReads.clear();
+		for (uint32_t i = 0; i < uring->entries; i++) {
+			freeReads.push_back(i);
+		}
+		return;
+	}
+#endif
+	quit = false;
+	nextRead = 0;
+	unsigned n = std::min(std::min(depth, (unsigned) BATCH_MAX_THREADS), (unsigned) std::max<size_t>(names.size(), 1));
+	for (unsigned i = 0; i < n; i++) {
+		threads.emplace_back(&SffBatchReader::readerThread, this);
+	}
+}
+
+void SffBatchReader::readerThread() {
+	for (;;) {
+		size_t i = nextRead++;
+		if (quit || i >= names.size()) {
+			return;
+		}
+		BatchFile& f = files[i];
+		f.failed = !readWholeFile(names[i].c_str(), &f.buf, &f.size);
+		std::lock_guard<std::mutex> lk(lock);
+		ready.push_back((uint32_t) i);
+		wake.notify_one();
+	}
+}
+
+#ifdef __linux__
+// Queues one read into the ring, the slot is owned by the read
+void SffBatchReader::submitRead(uint32_t slot) {
+	const BatchRead& r = reads[slot];
+	iovecs[slot].iov_base = files[r.file].buf + r.ofs;
+	iovecs[slot].iov_len = r.len;
+
+	// READV rather than READ, it is there since the first io_uring kernels
+	unsigned tail = *uring->sqTail;
+	unsigned idx = tail & *uring->sqMask;
+	struct io_uring_sqe* sqe = &uring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = files[r.file].fd;
+	sqe->addr = (uint64_t) (uintptr_t) &iovecs[slot];
+	sqe->len = 1;
+	sqe->off = r.ofs;
+	sqe->user_data = slot;
+	uring->sqArray[idx] = idx;
+	__atomic_store_n(uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+	toSubmit++;
+	numInFlight++;
+}
+
+// A read of file i is over. The file goes to next() once every chunk has
+// been queued and none is left in the kernel or waiting for a retry.
+void SffBatchReader::endRead(uint32_t i) {
+	BatchFile& f = files[i];
+	f.inFlight--;
+	if (f.inFlight == 0 && f.queued == f.size && f.fd >= 0) {
+		::close(f.fd);
+		f.fd = -1;
+		ready.push_back(i);
+	}
+}
+
+// No more chunks of a failed file are queued
+void SffBatchReader::failFile(uint32_t i) {
+	BatchFile& f = files[i];
+	f.failed = true;
+	if (f.queued < f.size) {
+		f.queued = f.size;
+		if (nextOpen == i) {
+			nextOpen++;
+		}
+	}
+}
+#endif
+
+// Queues reads until the ring is full, false if nothing could be queued.
+// Short reads being retried keep their slot and go first.
+bool SffBatchReader::fillRing() {
+#ifdef __linux__
+	bool queued = false;
+	while (!retries.empty()) {
+		uint32_t slot = retries.front();
+		retries.pop_front();
+		if (files[reads[slot].file].failed) {
+			freeReads.push_back(slot);
+			endRead(reads[slot].file);
+		} else {
+			submitRead(slot);
+		}
+		queued = true;
+	}
+	while (!freeReads.empty() && nextOpen < files.size()) {
+		// Rest of the file being queued, or open the next one
+		BatchFile& f = files[nextOpen];
+		if (f.fd < 0) {
+			f.fd = ::open(names[nextOpen].c_str(), O_RDONLY | O_CLOEXEC);
+			struct stat st;
+			if (f.fd < 0 || fstat(f.fd, &st) != 0 || st.st_size <= 0 || !(f.buf = (uint8_t*) malloc(st.st_size))) {
+				if (f.fd >= 0) ::close(f.fd);
+				f.fd = -1;
+				f.failed = true;
+				ready.push_back((uint32_t) nextOpen++);
+				queued = true;
+				continue;
+			}
+			f.size = (size_t) st.st_size;
+		}
+		BatchRead r;
+		r.file = (uint32_t) nextOpen;
+		r.ofs = f.queued;
+		r.len = (uint32_t) std::min((size_t) BATCH_CHUNK, f.size - f.queued);
+		f.queued += r.len;
+		f.inFlight++;
+		if (f.queued == f.size) {
+			nextOpen++;
+		}
+		uint32_t slot = freeReads.back();
+		freeReads.pop_back();
+		reads[slot] = r;
+		submitRead(slot);
+		queued = true;
+	}
+	return queued;
+#else
+	return false;
+#endif
+}
+
+void SffBatchReader::reapRing() {
+#ifdef __linux__
+	unsigned head = *uring->cqHead;
+	unsigned tail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		const struct io_uring_cqe* cqe = &uring->cqes[head & *uring->cqMask];
+		uint32_t slot = (uint32_t) cqe->user_data;
+		BatchRead& r = reads[slot];
+		BatchFile& f = files[r.file];
+		numInFlight--;
+		if (cqe->res <= 0) {
+			failFile(r.file);
+		} else if ((uint32_t) cqe->res < r.len) {
+			// Short read, the rest goes again with the same slot
+			f.done += cqe->res;
+			r.ofs += cqe->res;
+			r.len -= cqe->res;
+			retries.push_back(slot);
+			continue;
+		} else {
+			f.done += r.len;
+		}
+		freeReads.push_back(slot);
+		endRead(r.file);
+	}
+	__atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+#endif
+}
+
+int SffBatchReader::next(MappedFile& file) {
+	file.close();
+	if (numReturned >= names.size()) {
+		return -1;
+	}
+	if (uring) {
+#ifdef __linux__
+		// Reads keep going in the kernel while the caller works on the file
+		do {
+			fillRing();
+			if (ready.empty() && numInFlight == 0 && retries.empty()) {
+				return -1;
+			}
+			if (toSubmit || ready.empty()) {
+				if (enterUring(uring, toSubmit, ready.empty() ? 1 : 0) < 0) {
+					fprintf(stderr, "Error: io_uring_enter failed (%s)\n", strerror(errno));
+					return -1;
+				}
+				toSubmit = 0;
+			}
+			reapRing();
+		} while (ready.empty());
+#endif
+	} else {
+		std::unique_lock<std::mutex> lk(lock);
+		wake.wait(lk, [this] { return !ready.empty(); });
+	}
+	uint32_t i;
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		i = ready.front();
+		ready.pop_front();
+	}
+	BatchFile& f = files[i];
+	if (f.failed) {
+		free(f.buf);
+	} else {
+		file.adopt(f.buf, f.size);
+	}
+	f.buf = nullptr;
+	numReturned++;
+	return (int) i;
+}
+
+void SffBatchReader::stop() {
+	quit = true;
+	for (std::thread& t : threads) {
+		t.join();
+	}
+	threads.clear();
+#ifdef __linux__
+	if (uring) {
+		// Buffers can only go once the kernel is done with them
+		while (numInFlight > 0) {
+			if (enterUring(uring, toSubmit, 1) < 0) {
+				break;
+			}
+			toSubmit = 0;
+			reapRing();
+		}
+		retries.clear();
+		for (BatchFile& f : files) {
+			if (f.fd >= 0) ::close(f.fd);
+		}
+	}
+#endif
+	if (uring) {
+		closeUring(uring);
+		uring = nullptr;
+	}
+	for (BatchFile& f : files) {
+		free(f.buf);
+	}
+	files.clear();
+	names.clear();
+	ready.clear();
+	nextOpen = 0;
+	toSubmit = 0;
+	numInFlight = 0;
+}
+
+std::vector<std::string> listSffFiles(const char* root) {
+	std::vector<std::string> found;
+	std::error_code ec;
+	std::filesystem::recursive_directory_iterator it(root, std::filesystem::directory_options::skip_permission_denied, ec), end;
+	for (; !ec && it != end; it.increment(ec)) {
+		std::error_code fec;
+		if (it->is_regular_file(fec) && isSffFilename(it->path().string())) {
+			found.push_back(it->path().string());
+		}
+	}
+	std::sort(found.begin(), found.end());
+	return found;
+}
+
+// Header parse of a file already in memory, as a batch job would do
+static bool parseSff(const char* filename, MappedFile& file) {
+	Sff sff;
+	sff.headless = true;
+	strncpy(sff.filename, filename, 255);
+	sff.file.swap(file);
+	return readSffHeaders(&sff, nullptr) == 0;
+}
+
+static void printReadResult(const char* name, size_t numFiles, size_t numFailed, uint64_t bytes, std::chrono::steady_clock::time_point t0) {
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	printf("%-8s %6zu files %4zu failed %9.1f MB %8.3f s %10.0f files/s %8.1f MB/s\n", name, numFiles, numFailed,
+		bytes / (1024.0 * 1024.0), secs, numFiles / secs, bytes / (1024.0 * 1024.0) / secs);
+}
+
+// Reads and parses the headers of every SFF below root with stdio, with
+// MappedFile (what loadMugenSprite uses) and with SffBatchReader
+int benchmarkBatchRead(const char* root, unsigned depth) {
+	std::vector<std::string> names = listSffFiles(root);
+	if (names.empty()) {
+		fprintf(stderr, "Error: no SFF file below %s\n", root);
+		return -1;
+	}
+	if (depth == 0) {
+		depth = 64;
+	}
+
+	// stdio, one blocking fopen/fread per file
+	auto t0 = std::chrono::steady_clock::now();
+	size_t numFailed = 0;
+	uint64_t bytes = 0;
+	for (const std::string& name : names) {
+		MappedFile file;
+		FILE* f = fopen(name.c_str(), "rb");
+		long fsize = -1;
+		if (f) {
+			fseek(f, 0, SEEK_END);
+			fsize = ftell(f);
+			fseek(f, 0, SEEK_SET);
+		}
+		uint8_t* buf = fsize > 0 ? (uint8_t*) malloc(fsize) : nullptr;
+		if (buf && fread(buf, fsize, 1, f) == 1) {
+			file.adopt(buf, fsize);
+			bytes += fsize;
+		} else {
+			free(buf);
+		}
+		if (f) fclose(f);
+		numFailed += !file.data() || !parseSff(name.c_str(), file);
+	}
+	printReadResult("stdio", names.size(), numFailed, bytes, t0);
+
+	// mmap, pages are read as the parser touches them
+	t0 = std::chrono::steady_clock::now();
+	numFailed = 0;
+	bytes = 0;
+	for (const std::string& name : names) {
+		MappedFile file;
+		bool ok = file.open(name.c_str());
+		bytes += file.size();
+		numFailed += !ok || !parseSff(name.c_str(), file);
+	}
+	printReadResult("mmap", names.size(), numFailed, bytes, t0);
+
+	t0 = std::chrono::steady_clock::now();
+	numFailed = 0;
+	bytes = 0;
+	SffBatchReader reader;
+	reader.start(names, depth);
+	MappedFile file;
+	for (int i; (i = reader.next(file)) >= 0;) {
+		bytes += file.size();
+		numFailed += !file.data() || !parseSff(names[i].c_str(), file);
+	}
+	printReadResult(reader.usingUring() ? "io_uring" : "pread", names.size(), numFailed, bytes, t0);
+	reader.stop();
+	printf("Depth %u. Later passes find the files in the page cache, drop it before each run for cold numbers.\n", depth);
+	return 0;
+}
@@ -0,0 +1,276 @@
+#include "mugen_sff.h"
+
+// Decoder benchmarks
+//
+// Payloads of one format are collected from real SFF files, then every decoder
+// runs over all of them, pass after pass, for BENCH_SECONDS. Each decoder is
+// first checked to give the same pixels as the reference one.
+
+#define BENCH_SECONDS 0.5
+
+typedef struct {
+	const uint8_t* src;		// payload without the 4 byte length prefix
+	size_t srcLen;
+	size_t dstLen;
+} BenchSprite;
+
+// Opens the files headless and collects their v2 sprites by format (Sprite::rle).
+// The files stay open (payloads point into them) until closeBenchFiles.
+static void collectBenchSprites(const std::vector<const char*>& filenames, std::vector<Sff*>& files, std::map<int, std::vector<BenchSprite>>& sprites) {
+	for (const char* filename : filenames) {
+		Sff* sff = new Sff();
+		sff->headless = true;
+		strncpy(sff->filename, filename, 255);
+		if (!sff->file.open(filename) || readSffHeaders(sff, nullptr) != 0) {
+			fprintf(stderr, "Warning: can not parse %s\n", filename);
+			delete sff;
+			continue;
+		}
+		files.push_back(sff);
+		if (sff->header.Ver0 != 2) {
+			continue;
+		}
+		for (const Sprite& s : sff->sprites) {
+			if (s.link >= 0 || s.data_len <= 4 || (uint64_t) s.data_ofs + s.data_len > sff->file.size()) {
+				continue;
+			}
+			const uint8_t* src = sff->file.data() + s.data_ofs + 4;
+			size_t dstLen = s.rle <= -10 ? pngDecodeBytes(s, src, s.data_len - 4) : (size_t) s.Size[0] * s.Size[1];
+			if (dstLen > 0) {
+				sprites[s.rle].push_back({ src, s.data_len - 4, dstLen });
+			}
+		}
+	}
+}
+
+static void closeBenchFiles(std::vector<Sff*>& files) {
+	for (Sff* sff : files) {
+		delete sff;
+	}
+	files.clear();
+}
+
+// Decodes every sprite with decode until BENCH_SECONDS have passed, returns the decoded MB/s
+template <typename F>
+static double timeDecoder(const std::vector<BenchSprite>& sprites, F decode) {
+	uint64_t bytes = 0;
+	auto t0 = std::chrono::steady_clock::now();
+	double secs;
+	do {
+		for (const BenchSprite& s : sprites) {
+			decode(s);
+			bytes += s.dstLen;
+		}
+		secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	} while (secs < BENCH_SECONDS);
+	return bytes / (1024.0 * 1024.0) / secs;
+}
+
+// mallocs per sprite lodepng makes in one pass of decode, with its pool on or
+// off. The pass before warms the pool up.
+static double mallocsPerSprite(const std::vector<BenchSprite>& sprites, const DecodeKernel& k, uint8_t* out, bool pool) {
+	setPngPool(pool);
+	for (int pass = 0; pass < 2; pass++) {
+		PngAllocStats before = pngAllocStats();
+		for (const BenchSprite& s : sprites) {
+			k.decode(s.src, s.srcLen, out, s.dstLen);
+		}
+		if (pass == 1) {
+			setPngPool(true);
+			return (double) (pngAllocStats().mallocs - before.mallocs) / sprites.size();
+		}
+	}
+	return 0;
+}
+
+// Times every kernel on the sprites, the first one is the reference the
+// others are checked against and compared to
+static void benchKernels(const char* format, const std::vector<BenchSprite>& sprites, size_t numFiles, const std::vector<DecodeKernel>& kernels) {
+	if (sprites.empty()) {
+		printf("%s: no sprite\n", format);
+		return;
+	}
+	uint64_t srcBytes = 0, dstBytes = 0;
+	size_t maxLen = 0;
+	for (const BenchSprite& s : sprites) {
+		srcBytes += s.srcLen;
+		dstBytes += s.dstLen;
+		maxLen = std::max(maxLen, s.dstLen);
+	}
+	printf("%s: %zu sprites from %zu files, %.2f MB compressed, %.2f MB decoded per pass\n",
+		format, sprites.size(), numFiles, srcBytes / (1024.0 * 1024.0), dstBytes / (1024.0 * 1024.0));
+
+	std::vector<uint8_t> ref(maxLen), out(maxLen);
+	double refSpeed = 0;
+	for (const DecodeKernel& k : kernels) {
+		bool same = true;
+		for (const BenchSprite& s : sprites) {
+			kernels[0].decode(s.src, s.srcLen, ref.data(), s.dstLen);
+			k.decode(s.src, s.srcLen, out.data(), s.dstLen);
+			same = same && memcmp(ref.data(), out.data(), s.dstLen) == 0;
+		}
+		double speed = timeDecoder(sprites, [&](const BenchSprite& s) { k.decode(s.src, s.srcLen, out.data(), s.dstLen); });
+		if (refSpeed == 0) {
+			refSpeed = speed;
+		}
+		double unpooled = mallocsPerSprite(sprites, k, out.data(), false);
+		if (unpooled > 0) {
+			printf("  %-10s %9.1f MB/s  x%.2f  %.1f mallocs/sprite (%.1f without pool)%s\n",
+				k.name, speed, speed / refSpeed, mallocsPerSprite(sprites, k, out.data(), true), unpooled, same ? "" : "  MISMATCH");
+		} else {
+			printf("  %-10s %9.1f MB/s  x%.2f%s\n", k.name, speed, speed / refSpeed, same ? "" : "  MISMATCH");
+		}
+	}
+}
+
+// Whole PngDecode of a PNG10/11/12 sprite, taking the given path (PNG_LODEPNG...)
+template <int RLE, int PATH>
+static void pngKernel(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen) {
+	Sprite s;
+	s.rle = RLE;
+	PngDecode(s, src, srcLen, { dst, dstLen }, PATH);
+}
+
+// Decoded indices of the paletted sprites of the files, one after the other
+// in pixels. Each BenchSprite gives a sprite's indices and their number.
+static void collectPalettedPixels(const std::vector<Sff*>& files, std::vector<uint8_t>& pixels, std::vector<BenchSprite>& sprites) {
+	std::vector<size_t> ofs;
+	PixelBuffer buf = { NULL, 0 };
+	for (Sff* sff : files) {
+		for (Sprite s : sff->sprites) {
+			if (isRGBASprite(s) || s.link >= 0 || !decodeSprite(sff, s, buf)) {
+				continue;
+			}
+			size_t n = (size_t) s.Size[0] * s.Size[1];
+			if (n > 0) {
+				ofs.push_back(pixels.size());
+				pixels.insert(pixels.end(), buf.data, buf.data + n);
+			}
+		}
+	}
+	free(buf.data);
+	for (size_t i = 0; i < ofs.size(); i++) {
+		size_t n = (i + 1 < ofs.size() ? ofs[i + 1] : pixels.size()) - ofs[i];
+		sprites.push_back({ pixels.data() + ofs[i], n, n });
+	}
+}
+
+// Expands the sprites to RGBA with every palette kernel, checked against the
+// reference one, and prints Mpx/s
+static void benchPaletteKernels(const std::vector<BenchSprite>& sprites) {
+	if (sprites.empty()) {
+		printf("Palette expansion: no sprite\n");
+		return;
+	}
+	uint64_t numPixels = 0;
+	size_t maxLen = 0;
+	for (const BenchSprite& s : sprites) {
+		numPixels += s.dstLen;
+		maxLen = std::max(maxLen, s.dstLen);
+	}
+	printf("Palette expansion: %zu paletted sprites, %.2f Mpx per pass\n", sprites.size(), numPixels / 1e6);
+
+	uint32_t pal[256];
+	for (uint32_t i = 0; i < 256; i++) {
+		pal[i] = i * 0x9e3779b9u;
+	}
+	std::vector<uint32_t> ref(maxLen), out(maxLen);
+	double refSpeed = 0;
+	for (const PaletteKernel& k : paletteKernels()) {
+		bool same = true;
+		for (const BenchSprite& s : sprites) {
+			expandPaletteReference(s.src, s.dstLen, pal, ref.data());
+			k.expand(s.src, s.dstLen, pal, out.data());
+			same = same && memcmp(ref.data(), out.data(), s.dstLen * 4) == 0;
+		}
+		// timeDecoder counts dstLen, pixels here, in units of 2^20
+		double speed = timeDecoder(sprites, [&](const BenchSprite& s) { k.expand(s.src, s.dstLen, pal, out.data()); }) * (1024.0 * 1024.0 / 1e6);
+		if (refSpeed == 0) {
+			refSpeed = speed;
+		}
+		printf("  %-10s %9.1f Mpx/s  x%.2f%s\n", k.name, speed, speed / refSpeed, same ? "" : "  MISMATCH");
+	}
+}
+
+// Decodes the PNG sprites of the files on a SpriteDecodePool of numThreads
+// workers, file after file, until BENCH_SECONDS of decoding have passed
+static PngBatchStats benchPngBatch(const std::vector<Sff*>& files, unsigned numThreads) {
+	PngBatchStats total = {};
+	do {
+		for (Sff* sff : files) {
+			SpriteDecodePool pool;
+			pool.start(sff, numThreads);
+			for (uint32_t i = 0; i < sff->sprites.size(); i++) {
+				const Sprite& s = sff->sprites[i];
+				if (s.rle <= -10 && s.link < 0 && s.data_len > 4) {
+					pool.push(i);
+				}
+			}
+			pool.finish();
+			DecodedSprite d;
+			while (pool.pop(d)) {
+				pool.recycle(d);
+			}
+			PngBatchStats stats = pool.pngStats();
+			total.sprites += stats.sprites;
+			total.bytesIn += stats.bytesIn;
+			total.pixelsOut += stats.pixelsOut;
+			total.seconds += stats.seconds;
+		}
+	} while (total.sprites > 0 && total.seconds < BENCH_SECONDS);
+	return total;
+}
+
+// Runs every decoder on the sprites of the files, format by format
+int benchmarkDecoders(const std::vector<const char*>& filenames) {
+	struct {
+		const char* format;
+		int rle;
+		std::vector<DecodeKernel> kernels;
+	} suite[] = {
+		{ "RLE8", -2, rle8Kernels() },
+		{ "RLE5", -3, { { "reference", rle5DecodeReference }, { "table", rle5DecodeTable } } },
+		{ "LZ5", -4, { { "reference", lz5DecodeReference }, { "fast", lz5DecodeFast } } },
+		{ "PNG10", -10, { { "lodepng", pngKernel<-10, PNG_LODEPNG> }, { "inflate", pngKernel<-10, PNG_INFLATE> }, { "direct", pngKernel<-10, PNG_DIRECT> } } },
+		{ "PNG11", -11, { { "lodepng", pngKernel<-11, PNG_LODEPNG> }, { "inflate", pngKernel<-11, PNG_INFLATE> } } },
+		{ "PNG12", -12, { { "lodepng", pngKernel<-12, PNG_LODEPNG> }, { "inflate", pngKernel<-12, PNG_INFLATE> } } },
+	};
+	std::vector<Sff*> files;
+	std::map<int, std::vector<BenchSprite>> sprites;
+	collectBenchSprites(filenames, files, sprites);
+	if (files.empty()) {
+		fprintf(stderr, "Error: none of the files could be parsed\n");
+		return -1;
+	}
+	for (auto& b : suite) {
+		benchKernels(b.format, sprites[b.rle], files.size(), b.kernels);
+	}
+
+	std::vector<uint8_t> pixels;
+	std::vector<BenchSprite> paletted;
+	collectPalettedPixels(files, pixels, paletted);
+	benchPaletteKernels(paletted);
+
+	// Whole PNG sprites as a load decodes them, one worker against all cores
+	unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+	printf("PNG batch (SpriteDecodePool, largest first):\n");
+	double refSpeed = 0;
+	for (unsigned numThreads : { 1u, cores }) {
+		PngBatchStats stats = benchPngBatch(files, numThreads);
+		if (stats.sprites == 0) {
+			printf("  no sprite\n");
+			break;
+		}
+		double speed = stats.bytesIn / (1024.0 * 1024.0) / stats.seconds;
+		if (refSpeed == 0) {
+			refSpeed = speed;
+		}
+		printf("  %2u thread%s %9.1f MB/s in %9.1f Mpx/s out  x%.2f\n",
+			numThreads, numThreads > 1 ? "s" : " ", speed, stats.pixelsOut / 1e6 / stats.seconds, speed / refSpeed);
+		if (cores == 1) {
+			break;
+		}
+	}
+	closeBenchFiles(files);
+	return 0;
+}
@@ -0,0 +1,153 @@
+#include "mugen_sff.h"
+#include <filesystem>
+
+// Decoded pixel cache
+//
+// PNG sprites dominate the load time of HD characters, so their decoded pixels
+// can be kept in the user cache directory, one file per payload hash:
+//   SpritePixelHeader
+//   Size[0] * Size[1] * bpp raw pixels
+// A hit is a single fread straight into the buffer handed to texture upload.
+// Files are touched on every hit and trimPixelCache removes the least recently
+// used ones once the directory grows past its budget. Loads trim once they
+// wrote new files (trimPixelCacheWrites), deleteMugenSprite always does.
+
+#define PIXEL_CACHE_MAGIC "SPX1"
+
+typedef struct __attribute__((packed)) {
+	char magic[4];
+	uint16_t Size[2];
+	uint32_t len;
+} SpritePixelHeader;
+
+// Bytes written to the cache since the last trim
+static std::atomic<uint64_t> writtenSinceTrim(0);
+
+static unsigned long processId() {
+#ifdef _WIN32
+	return GetCurrentProcessId();
+#else
+	return (unsigned long) getpid();
+#endif
+}
+
+static const std::string& pixelCacheDir() {
+	static const std::string dir = sffCacheDir("pixels");
+	return dir;
+}
+
+// Same payload decoded by another format would give other pixels
+static std::string pixelCachePath(const Sprite& s, uint64_t hash) {
+	char name[40];
+	snprintf(name, sizeof(name), "%016llx_%d.px", (unsigned long long) hash, -s.rle);
+	return (std::filesystem::path(pixelCacheDir()) / name).string();
+}
+
+// Reads the cached pixels of s into dst, -1 if none (or they do not fit)
+int readCachedPixels(Sprite& s, uint64_t hash, PixelSpan dst) {
+	std::string path = pixelCachePath(s, hash);
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f) {
+		return -1;
+	}
+	SpritePixelHeader h;
+	bool ok = false;
+	if (fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, PIXEL_CACHE_MAGIC, 4) == 0) {
+		Sprite tmp = s;
+		tmp.Size[0] = h.Size[0];
+		tmp.Size[1] = h.Size[1];
+		if (h.len == spriteTextureBytes(tmp) && h.len > 0) {
+			if (h.len > dst.len) {
+				fclose(f);
+				return -1;
+			}
+			ok = fread(dst.data, 1, h.len, f) == h.len;
+		}
+	}
+	fclose(f);
+	if (!ok) {
+		fprintf(stderr, "Warning: removing damaged pixel cache file %s\n", path.c_str());
+		std::error_code ec;
+		std::filesystem::remove(path, ec);
+		return -1;
+	}
+	s.Size[0] = h.Size[0];
+	s.Size[1] = h.Size[1];
+
+	// Mark as recently used
+	std::error_code ec;
+	std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+	return 0;
+}
+
+int writeCachedPixels(const Sprite& s, uint64_t hash, const uint8_t* px) {
+	SpritePixelHeader h;
+	memcpy(h.magic, PIXEL_CACHE_MAGIC, 4);
+	h.Size[0] = s.Size[0];
+	h.Size[1] = s.Size[1];
+	h.len = spriteTextureBytes(s);
+
+	// Workers of this and other viewers may write the same payload at once,
+	// each one uses its own temp file
+	std::string path = pixelCachePath(s, hash);
+	char suffix[48];
+	snprintf(suffix, sizeof(suffix), ".%lx_%zx.tmp", processId(), std::hash<std::thread::id>{}(std::this_thread::get_id()));
+	std::string tmp = path + suffix;
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f) {
+		return -1;
+	}
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(px, 1, h.len, f) == h.len;
+	ok = fclose(f) == 0 && ok;
+	std::error_code ec;
+	if (ok) {
+		std::filesystem::rename(tmp, path, ec);
+	}
+	if (!ok || ec) {
+		std::filesystem::remove(tmp, ec);
+		return -1;
+	}
+	writtenSinceTrim.fetch_add(sizeof(h) + h.len, std::memory_order_relaxed);
+	return 0;
+}
+
+// Removes least recently used files until the cache fits in budget bytes
+void trimPixelCache(size_t budget) {
+	writtenSinceTrim = 0;
+	struct Entry {
+		std::filesystem::file_time_type time;
+		uintmax_t size;
+		std::filesystem::path path;
+	};
+	std::vector<Entry> entries;
+	uintmax_t total = 0;
+	std::error_code ec;
+	for (const auto& e : std::filesystem::directory_iterator(pixelCacheDir(), ec)) {
+		std::error_code eec;
+		uintmax_t size = e.file_size(eec);
+		if (eec) continue;
+		auto time = e.last_write_time(eec);
+		if (eec) continue;
+		entries.push_back({ time, size, e.path() });
+		total += size;
+	}
+	if (total <= budget) {
+		return;
+	}
+	std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+	for (const Entry& e : entries) {
+		if (total <= budget) {
+			break;
+		}
+		if (std::filesystem::remove(e.path, ec)) {
+			total -= e.size;
+		}
+	}
+}
+
+// Trims the cache once more than slack bytes were written since the last trim
+void trimPixelCacheWrites(size_t budget, size_t slack) {
+	if (writtenSinceTrim.load(std::memory_order_relaxed) > slack) {
+		trimPixelCache(budget);
+	}
+}
@@ -0,0 +1,330 @@
+#include "mugen_sff.h"
+#include <filesystem>
+
+// SFF catalog
+//
+// Header metadata of every SFF below a directory, for questions about a whole
+// roster without opening each file. The catalog is a single file:
+//   SffCatalogHeader
+//   for each SFF: SffCatalogFile, path (pathLen bytes), SffCatalogSprite[numSprites]
+// Files are sorted by path. Only headers are parsed, no pixel is decoded and no
+// texture is created. A rescan copies the records of files whose size and mtime
+// did not change from the previous catalog.
+
+#define SFF_CATALOG_MAGIC "SFFCAT\x1a"
+#define SFF_CATALOG_VERSION 1
+
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint32_t version;
+	uint32_t numFiles;
+	uint64_t numSprites;
+} SffCatalogHeader;
+
+typedef struct __attribute__((packed)) {
+	uint64_t fileSize;
+	int64_t fileTime;
+	uint8_t Ver[4];			// all 0 if the file could not be parsed
+	uint32_t numSprites;
+	uint32_t numPalettes;
+	uint32_t numLinkedSprites;
+	uint16_t pathLen;
+} SffCatalogFile;
+
+typedef struct __attribute__((packed)) {
+	uint16_t Group;
+	uint16_t Number;
+	uint16_t Size[2];
+	int16_t Offset[2];
+	int8_t rle;				// format as in Sprite::rle
+	uint8_t coldepth;
+	int32_t palidx;
+	int32_t link;			// -1 if none
+	uint32_t data_len;		// payload bytes
+} SffCatalogSprite;
+
+typedef struct {
+	std::string path;
+	std::vector<uint8_t> record;	// SffCatalogFile, path and sprites
+	bool parsed;
+} CatalogEntry;
+
+// Directories and files waiting for a worker
+typedef struct {
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<std::filesystem::directory_entry> work;
+	int busy = 0;
+	std::vector<CatalogEntry> entries;
+	std::map<std::string, std::vector<uint8_t>> previous;	// records of the old catalog by path
+} CatalogScan;
+
+static void appendBytes(std::vector<uint8_t>& out, const void* p, size_t len) {
+	out.insert(out.end(), (const uint8_t*) p, (const uint8_t*) p + len);
+}
+
+static std::vector<uint8_t> catalogRecord(const std::string& path, uint64_t fileSize, int64_t fileTime) {
+	SffCatalogFile f = {};
+	f.fileSize = fileSize;
+	f.fileTime = fileTime;
+	f.pathLen = (uint16_t) path.size();
+
+	Sff sff;
+	sff.headless = true;
+	std::vector<uint8_t> sprites;
+	strncpy(sff.filename, path.c_str(), 255);
+	if (sff.file.open(path.c_str()) && readSffHeaders(&sff, nullptr) == 0) {
+		f.Ver[0] = sff.header.Ver3;
+		f.Ver[1] = sff.header.Ver2;
+		f.Ver[2] = sff.header.Ver1;
+		f.Ver[3] = sff.header.Ver0;
+		f.numSprites = sff.header.NumberOfSprites;
+		f.numPalettes = sff.header.NumberOfPalettes;
+		f.numLinkedSprites = (uint32_t) sff.numLinkedSprites;
+		sprites.reserve(f.numSprites * sizeof(SffCatalogSprite));
+		for (uint32_t i = 0; i < f.numSprites; i++) {
+			const Sprite& s = sff.sprites[i];
+			SffCatalogSprite r;
+			r.Group = s.Group;
+			r.Number = s.Number;
+			r.Size[0] = s.Size[0];
+			r.Size[1] = s.Size[1];
+			r.Offset[0] = s.Offset[0];
+			r.Offset[1] = s.Offset[1];
+			r.rle = (int8_t) s.rle;
+			r.coldepth = s.coldepth;
+			r.palidx = s.palidx;
+			r.link = s.link;
+			r.data_len = s.data_len;
+			appendBytes(sprites, &r, sizeof(r));
+		}
+	} else {
+		fprintf(stderr, "Warning: can not parse %s\n", path.c_str());
+	}
+
+	std::vector<uint8_t> record;
+	record.reserve(sizeof(f) + path.size() + sprites.size());
+	appendBytes(record, &f, sizeof(f));
+	appendBytes(record, path.data(), path.size());
+	record.insert(record.end(), sprites.begin(), sprites.end());
+	return record;
+}
+
+// Iterates the file records of a catalog, calls fn(path, record, len) for each
+// one. Returns -1 if the catalog is damaged.
+template <typename F>
+static int forEachCatalogFile(const uint8_t* data, size_t size, F fn) {
+	if (size < sizeof(SffCatalogHeader)) {
+		return -1;
+	}
+	const SffCatalogHeader* h = (const SffCatalogHeader*) data;
+	if (memcmp(h->magic, SFF_CATALOG_MAGIC, sizeof(h->magic)) != 0 || h->version != SFF_CATALOG_VERSION) {
+		return -1;
+	}
+	size_t ofs = sizeof(SffCatalogHeader);
+	for (uint32_t i = 0; i < h->numFiles; i++) {
+		if (size - ofs < sizeof(SffCatalogFile)) {
+			return -1;
+		}
+		const SffCatalogFile* f = (const SffCatalogFile*) (data + ofs);
+		uint64_t len = sizeof(SffCatalogFile) + f->pathLen + (uint64_t) f->numSprites * sizeof(SffCatalogSprite);
+		if (size - ofs < len) {
+			return -1;
+		}
+		fn(std::string((const char*) (f + 1), f->pathLen), data + ofs, (size_t) len);
+		ofs += len;
+	}
+	return ofs == size ? 0 : -1;
+}
+
+static const char* formatName(int rle) {
+	switch (rle) {
+	case -1: return "PCX";
+	case -2: return "RLE8";
+	case -3: return "RLE5";
+	case -4: return "LZ5";
+	case -10: return "PNG10";
+	case -11: return "PNG11";
+	case -12: return "PNG12";
+	}
+	return "raw";
+}
+
+bool isSffFilename(const std::string& path) {
+	std::string ext = std::filesystem::path(path).extension().string();
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	return ext == ".sff";
+}
+
+static void scanFile(CatalogScan* scan, const std::filesystem::directory_entry& e) {
+	std::error_code ec;
+	uint64_t fileSize = e.file_size(ec);
+	if (ec) return;
+	int64_t fileTime = (int64_t) e.last_write_time(ec).time_since_epoch().count();
+	if (ec) return;
+	std::string path = e.path().string();
+
+	// previous is not modified while workers run
+	auto it = scan->previous.find(path);
+	if (it != scan->previous.end()) {
+		const SffCatalogFile* f = (const SffCatalogFile*) it->second.data();
+		if (f->fileSize == fileSize && f->fileTime == fileTime) {
+			std::lock_guard<std::mutex> lk(scan->lock);
+			scan->entries.push_back({ path, it->second, false });
+			return;
+		}
+	}
+	CatalogEntry entry = { path, catalogRecord(path, fileSize, fileTime), true };
+	std::lock_guard<std::mutex> lk(scan->lock);
+	scan->entries.push_back(std::move(entry));
+}
+
+// Workers list directories and parse files from the same queue, so the walk of
+// a deep tree and the parsing of its SFF overlap
+static void catalogWorker(CatalogScan* scan) {
+	std::unique_lock<std::mutex> lk(scan->lock);
+	for (;;) {
+		scan->wake.wait(lk, [scan] { return !scan->work.empty() || scan->busy == 0; });
+		if (scan->work.empty()) {
+			// Nothing queued and nobody left to queue more
+			scan->wake.notify_all();
+			return;
+		}
+		std::filesystem::directory_entry e = scan->work.front();
+		scan->work.pop_front();
+		scan->busy++;
+		lk.unlock();
+
+		std::error_code ec;
+		if (e.is_directory(ec)) {
+			std::vector<std::filesystem::directory_entry> found;
+			for (const auto& child : std::filesystem::directory_iterator(e.path(), std::filesystem::directory_options::skip_permission_denied, ec)) {
+				std::error_code cec;
+				// Symlinked directories are not followed, they could loop
+				if (child.is_directory(cec) && !child.is_symlink(cec)) {
+					found.push_back(child);
+				} else if (child.is_regular_file(cec) && isSffFilename(child.path().string())) {
+					found.push_back(child);
+				}
+			}
+			lk.lock();
+			scan->work.insert(scan->work.end(), found.begin(), found.end());
+			lk.unlock();
+		} else {
+			scanFile(scan, e);
+		}
+
+		lk.lock();
+		scan->busy--;
+		scan->wake.notify_all();
+	}
+}
+
+// Writes the catalog of all SFF below root to catalogPath, reusing the records
+// of an existing catalog there for unchanged files. numThreads 0 = one per core.
+int buildSffCatalog(const char* root, const char* catalogPath, unsigned numThreads) {
+	auto t0 = std::chrono::steady_clock::now();
+	std::error_code ec;
+	std::filesystem::directory_entry rootEntry(root, ec);
+	if (ec || !rootEntry.is_directory(ec)) {
+		fprintf(stderr, "Error: %s is not a directory\n", root);
+		return -1;
+	}
+
+	CatalogScan scan;
+	{
+		MappedFile old;
+		if (old.open(catalogPath)) {
+			int rc = forEachCatalogFile(old.data(), old.size(), [&](const std::string& path, const uint8_t* rec, size_t len) {
+				scan.previous[path].assign(rec, rec + len);
+			});
+			if (rc != 0) {
+				fprintf(stderr, "Warning: ignoring damaged catalog %s\n", catalogPath);
+				scan.previous.clear();
+			}
+		}
+	}
+
+	if (numThreads == 0) {
+		numThreads = std::thread::hardware_concurrency();
+	}
+	if (numThreads == 0) {
+		numThreads = 1;
+	}
+	scan.work.push_back(rootEntry);
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < numThreads; i++) {
+		workers.emplace_back(catalogWorker, &scan);
+	}
+	for (std::thread& t : workers) {
+		t.join();
+	}
+	std::sort(scan.entries.begin(), scan.entries.end(), [](const CatalogEntry& a, const CatalogEntry& b) { return a.path < b.path; });
+
+	// Summary while writing
+	SffCatalogHeader h = {};
+	memcpy(h.magic, SFF_CATALOG_MAGIC, sizeof(h.magic));
+	h.version = SFF_CATALOG_VERSION;
+	h.numFiles = (uint32_t) scan.entries.size();
+	size_t numParsed = 0, numFailed = 0;
+	uint64_t payloadBytes = 0;
+	std::map<int, std::pair<uint64_t, uint32_t>> formats;	// rle -> sprites, files
+	const CatalogEntry* largestFile = nullptr;
+	SffCatalogSprite largest = {};
+	for (const CatalogEntry& e : scan.entries) {
+		const SffCatalogFile* f = (const SffCatalogFile*) e.record.data();
+		const SffCatalogSprite* sprites = (const SffCatalogSprite*) (e.record.data() + sizeof(SffCatalogFile) + f->pathLen);
+		numParsed += e.parsed;
+		numFailed += f->Ver[3] == 0;
+		h.numSprites += f->numSprites;
+		std::set<int> used;
+		for (uint32_t i = 0; i < f->numSprites; i++) {
+			SffCatalogSprite s;
+			memcpy(&s, &sprites[i], sizeof(s));
+			payloadBytes += s.data_len;
+			if (s.data_len > 0) {
+				formats[s.rle].first++;
+				used.insert(s.rle);
+			}
+			if ((uint32_t) s.Size[0] * s.Size[1] > (uint32_t) largest.Size[0] * largest.Size[1]) {
+				largest = s;
+				largestFile = &e;
+			}
+		}
+		for (int rle : used) {
+			formats[rle].second++;
+		}
+	}
+
+	std::string tmp = std::string(catalogPath) + ".tmp";
+	FILE* out = fopen(tmp.c_str(), "wb");
+	if (!out) {
+		fprintf(stderr, "Error: can not write %s\n", tmp.c_str());
+		return -1;
+	}
+	bool ok = fwrite(&h, sizeof(h), 1, out) == 1;
+	for (const CatalogEntry& e : scan.entries) {
+		ok = ok && fwrite(e.record.data(), 1, e.record.size(), out) == e.record.size();
+	}
+	ok = fclose(out) == 0 && ok;
+	if (ok) {
+		std::filesystem::rename(tmp, catalogPath, ec);
+	}
+	if (!ok || ec) {
+		fprintf(stderr, "Error: can not write %s\n", catalogPath);
+		std::filesystem::remove(tmp, ec);
+		return -1;
+	}
+
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	printf("Catalog %s: %u files (%zu parsed, %zu unchanged, %zu unreadable), %llu sprites, %.1f MB of payload, %.2f s\n",
+		catalogPath, h.numFiles, numParsed, scan.entries.size() - numParsed, numFailed,
+		(unsigned long long) h.numSprites, payloadBytes / (1024.0 * 1024.0), secs);
+	for (const auto& fmt : formats) {
+		printf("  %s: %llu sprites in %u files\n", formatName(fmt.first), (unsigned long long) fmt.second.first, fmt.second.second);
+	}
+	if (largestFile) {
+		printf("  largest sprite: %ux%u, %u,%u in %s\n", largest.Size[0], largest.Size[1], largest.Group, largest.Number, largestFile->path.c_str());
+	}
+	return 0;
+}
@@ -0,0 +1,305 @@
+#include "mugen_sff.h"
+#include <filesystem>
+
+// Header index sidecar (.sffidx)
+//
+// Everything readSffHeaders derives from an SFF, stored as flat little-endian
+// records so that reopening an unchanged file is a single mmap of the index:
+//   SffIndexHeader
+//   SffIndexSprite[NumberOfSprites]
+//   SffIndexPalette[NumberOfPalettes]
+// Indexes live in the user cache directory, named after a hash of the absolute
+// SFF path, and are only used when the SFF size and mtime still match.
+
+#define SFF_INDEX_MAGIC "SFFIDX\x1a"
+#define SFF_INDEX_VERSION 2
+
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint32_t version;
+	uint64_t fileSize;
+	int64_t fileTime;
+	uint8_t Ver[4];
+	uint32_t FirstSpriteHeaderOffset;
+	uint32_t FirstPaletteHeaderOffset;
+	uint32_t NumberOfSprites;
+	uint32_t NumberOfPalettes;
+	uint32_t lofs, tofs;
+	uint32_t numLinkedSprites;
+	uint32_t numDupPalettes;
+	char path[256];
+} SffIndexHeader;
+
+typedef struct __attribute__((packed)) {
+	uint16_t Group;
+	uint16_t Number;
+	uint16_t Size[2];		// decoded size (PNG sprites are inspected)
+	int16_t Offset[2];
+	int32_t palidx;
+	int8_t rle;
+	uint8_t coldepth;
+	int32_t link;			// resolved link target, -1 if none
+	uint32_t data_ofs;
+	uint32_t data_len;
+	uint64_t hash;			// payload hash, 0 for linked/empty sprites
+} SffIndexSprite;
+
+typedef struct __attribute__((packed)) {
+	uint32_t data_ofs;
+} SffIndexPalette;
+
+static bool sffFileIdentity(const char* filename, uint64_t* size, int64_t* mtime) {
+	std::error_code ec;
+	std::filesystem::path p(filename);
+	*size = std::filesystem::file_size(p, ec);
+	if (ec) return false;
+	auto t = std::filesystem::last_write_time(p, ec);
+	if (ec) return false;
+	*mtime = (int64_t) t.time_since_epoch().count();
+	return true;
+}
+
+static std::string absolutePath(const char* filename) {
+	std::error_code ec;
+	std::filesystem::path p = std::filesystem::absolute(filename, ec);
+	return ec ? std::string(filename) : p.lexically_normal().string();
+}
+
+// Cache directory of the viewer, created on demand
+std::string sffCacheDir(const char* subdir) {
+	std::filesystem::path dir;
+#ifdef _WIN32
+	const char* base = getenv("LOCALAPPDATA");
+	dir = std::filesystem::path(base ? base : ".") / "MugenSpriteViewer";
+#else
+	const char* xdg = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	if (xdg && *xdg) {
+		dir = std::filesystem::path(xdg) / "MugenSpriteViewer";
+	} else {
+		dir = std::filesystem::path(home ? home : ".") / ".cache" / "MugenSpriteViewer";
+	}
+#endif
+	dir /= subdir;
+	std::error_code ec;
+	std::filesystem::create_directories(dir, ec);
+	return dir.string();
+}
+
+std::string sffIndexPath(const char* filename) {
+	std::string abs = absolutePath(filename);
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.sffidx", (unsigned long long) hashBytes(abs.data(), abs.size(), 0));
+	return (std::filesystem::path(sffCacheDir("index")) / name).string();
+}
+
+// Fills sff from its index instead of parsing the SFF headers. The SFF must
+// already be mapped in sff->file. Returns -1 if there is no valid index.
+int readSffIndex(Sff* sff, SpriteDecodePool* pipeline) {
+	uint64_t fileSize;
+	int64_t fileTime;
+	if (!sffFileIdentity(sff->filename, &fileSize, &fileTime) || fileSize != sff->file.size()) {
+		return -1;
+	}
+
+	MappedFile idx;
+	if (!idx.open(sffIndexPath(sff->filename).c_str())) {
+		return -1;
+	}
+	if (idx.size() < sizeof(SffIndexHeader)) {
+		return -1;
+	}
+	const SffIndexHeader* h = (const SffIndexHeader*) idx.data();
+	std::string abs = absolutePath(sff->filename);
+	if (memcmp(h->magic, SFF_INDEX_MAGIC, sizeof(h->magic)) != 0 || h->version != SFF_INDEX_VERSION
+		|| h->fileSize != fileSize || h->fileTime != fileTime || strncmp(h->path, abs.c_str(), sizeof(h->path)) != 0) {
+		return -1;
+	}
+	if (idx.size() != sizeof(SffIndexHeader) + (uint64_t) h->NumberOfSprites * sizeof(SffIndexSprite) + (uint64_t) h->NumberOfPalettes * sizeof(SffIndexPalette)) {
+		fprintf(stderr, "Warning: ignoring truncated index for %s\n", sff->filename);
+		return -1;
+	}
+	const SffIndexSprite* sprRecords = (const SffIndexSprite*) (h + 1);
+	const SffIndexPalette* palRecords = (const SffIndexPalette*) (sprRecords + h->NumberOfSprites);
+
+	// Indices are used unchecked once loaded, a damaged index is not used at all.
+	// Like palette_usage, only sprites decoded with a palette need a valid one:
+	// RGBA sprites keep whatever index their SFF header has.
+	for (uint32_t i = 0; i < h->NumberOfSprites; i++) {
+		const SffIndexSprite& r = sprRecords[i];
+		bool paletted = r.link < 0 && r.data_len > 0
+			&& (h->Ver[3] == 1 || (r.rle >= -4 && r.rle <= -1) || r.rle == -10);	// isPalettedSprite
+		if (r.link < -1 || (r.link >= 0 && (uint32_t) r.link >= h->NumberOfSprites)
+			|| (paletted && (r.palidx < 0 || (uint32_t) r.palidx >= h->NumberOfPalettes))) {
+			fprintf(stderr, "Warning: ignoring index for %s, sprite %u is out of range\n", sff->filename, i);
+			return -1;
+		}
+	}
+
+	sff->header.Ver3 = h->Ver[0];
+	sff->header.Ver2 = h->Ver[1];
+	sff->header.Ver1 = h->Ver[2];
+	sff->header.Ver0 = h->Ver[3];
+	sff->header.FirstSpriteHeaderOffset = h->FirstSpriteHeaderOffset;
+	sff->header.FirstPaletteHeaderOffset = h->FirstPaletteHeaderOffset;
+	sff->header.NumberOfSprites = h->NumberOfSprites;
+	sff->header.NumberOfPalettes = h->NumberOfPalettes;
+	sff->lofs = h->lofs;
+	sff->tofs = h->tofs;
+	sff->numLinkedSprites = h->numLinkedSprites;
+	sff->numDupPalettes = h->numDupPalettes;
+
+	// Palettes: colors are still taken from the SFF itself
+	const uint8_t* data = sff->file.data();
+	size_t palSize = sff->header.Ver0 == 1 ? 768 : 1024;
+	sff->palettes.clear();
+	sff->palettes.reserve(h->NumberOfPalettes);
+	for (uint32_t i = 0; i < h->NumberOfPalettes; i++) {
+		const SffIndexPalette& p = palRecords[i];
+		if ((uint64_t) p.data_ofs + palSize <= fileSize) {
+			sff->palettes.emplace_back(sff->headless ? 0 : sharedPaletteTexture(data + p.data_ofs, sff->header.Ver0 == 1));
+		} else {
+			fprintf(stderr, "Warning: palette %u out of file bounds in index\n", i);
+			sff->palettes.emplace_back(0u);
+		}
+		sff->palettes.back().data_ofs = p.data_ofs;
+	}
+
+	sff->sprites.clear();
+	sff->sprites.resize(h->NumberOfSprites);
+	sff->palette_usage.clear();
+	sff->compression_format_usage.clear();
+	for (uint32_t i = 0; i < h->NumberOfSprites; i++) {
+		const SffIndexSprite& r = sprRecords[i];
+		Sprite& s = sff->sprites[i];
+		s.Group = r.Group;
+		s.Number = r.Number;
+		s.Size[0] = r.Size[0];
+		s.Size[1] = r.Size[1];
+		s.Offset[0] = r.Offset[0];
+		s.Offset[1] = r.Offset[1];
+		s.palidx = r.palidx;
+		s.rle = r.rle;
+		s.coldepth = r.coldepth;
+		s.link = r.link;
+		s.data_ofs = r.data_ofs;
+		s.data_len = r.data_len;
+		s.hash = r.hash;
+		if (s.link >= 0 || s.data_len == 0) {
+			continue;
+		}
+		if ((uint64_t) s.data_ofs + s.data_len > fileSize) {
+			fprintf(stderr, "Warning: sprite %u out of file bounds in index\n", i);
+			s.data_len = 0;
+			continue;
+		}
+		if (sff->header.Ver0 == 1 || isPalettedSprite(s)) {
+			sff->palette_usage[s.palidx]++;
+		}
+		sff->compression_format_usage[s.rle]++;
+		if (pipeline) {
+			pipeline->push(i);
+		}
+	}
+	return 0;
+}
+
+// Writes the index of a loaded SFF (headers parsed, file still mapped)
+int writeSffIndex(Sff* sff) {
+	SffIndexHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SFF_INDEX_MAGIC, sizeof(h.magic));
+	h.version = SFF_INDEX_VERSION;
+	uint64_t fileSize;
+	int64_t fileTime;
+	if (!sffFileIdentity(sff->filename, &fileSize, &fileTime) || fileSize != sff->file.size()) {
+		return -1;
+	}
+	h.fileSize = fileSize;
+	h.fileTime = fileTime;
+	std::string abs = absolutePath(sff->filename);
+	if (abs.size() >= sizeof(h.path)) {
+		return -1;
+	}
+	strncpy(h.path, abs.c_str(), sizeof(h.path) - 1);
+	h.Ver[0] = sff->header.Ver3;
+	h.Ver[1] = sff->header.Ver2;
+	h.Ver[2] = sff->header.Ver1;
+	h.Ver[3] = sff->header.Ver0;
+	h.FirstSpriteHeaderOffset = sff->header.FirstSpriteHeaderOffset;
+	h.FirstPaletteHeaderOffset = sff->header.FirstPaletteHeaderOffset;
+	h.NumberOfSprites = sff->sprites.size();
+	h.NumberOfPalettes = sff->palettes.size();
+	h.lofs = sff->lofs;
+	h.tofs = sff->tofs;
+	h.numLinkedSprites = sff->numLinkedSprites;
+	h.numDupPalettes = sff->numDupPalettes;
+
+	const uint8_t* data = sff->file.data();
+	std::vector<SffIndexSprite> sprRecords(h.NumberOfSprites);
+	for (uint32_t i = 0; i < h.NumberOfSprites; i++) {
+		const Sprite& s = sff->sprites[i];
+		SffIndexSprite& r = sprRecords[i];
+		r.Group = s.Group;
+		r.Number = s.Number;
+		r.Size[0] = s.Size[0];
+		r.Size[1] = s.Size[1];
+		r.Offset[0] = s.Offset[0];
+		r.Offset[1] = s.Offset[1];
+		r.palidx = s.palidx;
+		r.rle = (int8_t) s.rle;
+		r.coldepth = s.coldepth;
+		r.link = s.link;
+		r.data_ofs = s.data_ofs;
+		r.data_len = s.data_len;
+		r.hash = 0;
+		if (s.link >= 0 || s.data_len == 0) {
+			continue;
+		}
+		r.hash = s.hash ? s.hash : hashBytes(data + s.data_ofs, s.data_len, 0);
+		// PNG size in the sprite header may differ from the image itself
+		if (s.rle <= -10 && s.data_len > 4) {
+			unsigned w, h;
+			LodePNGState& state = pngDecodeState();
+			if (lodepng_inspect(&w, &h, &state, data + s.data_ofs + 4, s.data_len - 4) == 0) {
+				r.Size[0] = w;
+				r.Size[1] = h;
+			}
+		}
+	}
+	// Link targets get the decoded size too
+	for (uint32_t i = 0; i < h.NumberOfSprites; i++) {
+		if (sprRecords[i].link >= 0) {
+			sprRecords[i].Size[0] = sprRecords[sprRecords[i].link].Size[0];
+			sprRecords[i].Size[1] = sprRecords[sprRecords[i].link].Size[1];
+		}
+	}
+
+	std::vector<SffIndexPalette> palRecords(h.NumberOfPalettes);
+	for (uint32_t i = 0; i < h.NumberOfPalettes; i++) {
+		palRecords[i].data_ofs = sff->palettes[i].data_ofs;
+	}
+
+	// Write next to the final name, then rename so readers never see a partial index
+	std::string path = sffIndexPath(sff->filename);
+	std::string tmp = path + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f) {
+		fprintf(stderr, "Error creating index file: %s\n", tmp.c_str());
+		return -1;
+	}
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+	if (ok && h.NumberOfSprites) ok = fwrite(sprRecords.data(), sizeof(SffIndexSprite), sprRecords.size(), f) == sprRecords.size();
+	if (ok && h.NumberOfPalettes) ok = fwrite(palRecords.data(), sizeof(SffIndexPalette), palRecords.size(), f) == palRecords.size();
+	ok = fclose(f) == 0 && ok;
+	std::error_code ec;
+	if (ok) {
+		std::filesystem::rename(tmp, path, ec);
+	}
+	if (!ok || ec) {
+		fprintf(stderr, "Error writing index file: %s\n", path.c_str());
+		std::filesystem::remove(tmp, ec);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,495 @@
+#include "mugen_sff.h"
+
+// zlib stream decoder for PNG sprites, hooked into lodepng through
+// LodePNGDecompressSettings::custom_zlib in place of its own inflate.
+//
+// Huffman symbols are decoded with a single lookup in a table indexed by the
+// next input bits, codes longer than the table point to a second level table.
+// Table entries carry the literal, or the length/distance base and its count
+// of extra bits, so no second lookup is needed. Input is read 8 bytes at a
+// time into a 64 bit buffer, which holds enough bits for a whole
+// length/distance pair, and matches are copied 8 bytes at a time.
+
+#define INFLATE_LIT_BITS	10	// primary table index bits, literal/length code
+#define INFLATE_DIST_BITS	8	// primary table index bits, distance code
+#define INFLATE_CL_BITS		7	// code length code, never longer
+#define INFLATE_LIT_SIZE	((1 << INFLATE_LIT_BITS) + 288 * (1 << (15 - INFLATE_LIT_BITS)))
+#define INFLATE_DIST_SIZE	((1 << INFLATE_DIST_BITS) + 32 * (1 << (15 - INFLATE_DIST_BITS)))
+#define INFLATE_MAX_MATCH	258
+#define INFLATE_SLACK		(INFLATE_MAX_MATCH + 16)	// room kept past the output for 8 byte copies
+
+// Table entry: bits 0-4 code length, 8-11 extra bits (or second level table
+// bits), 12-14 flags, 16-31 literal, base value or second level table offset.
+// An entry of a length or distance with a zero base is an invalid code.
+#define HUFF_LIT	0x1000
+#define HUFF_EOB	0x2000
+#define HUFF_SUB	0x4000
+
+static inline unsigned readU16le(const uint8_t* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t readU32be(const uint8_t* p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static const uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t DIST_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t DIST_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t CL_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// What each symbol decodes to, without the code length
+typedef struct InflateSymbols {
+	uint32_t lit[288], dist[32], cl[19];
+	InflateSymbols() {
+		for (unsigned i = 0; i < 288; i++) {
+			if (i < 256) {
+				lit[i] = (i << 16) | HUFF_LIT;
+			} else if (i == 256) {
+				lit[i] = HUFF_EOB;
+			} else if (i < 286) {
+				lit[i] = ((uint32_t) LENGTH_BASE[i - 257] << 16) | (LENGTH_EXTRA[i - 257] << 8);
+			} else {
+				lit[i] = 0;
+			}
+		}
+		for (unsigned i = 0; i < 32; i++) {
+			dist[i] = i < 30 ? ((uint32_t) DIST_BASE[i] << 16) | (DIST_EXTRA[i] << 8) : 0;
+		}
+		for (unsigned i = 0; i < 19; i++) {
+			cl[i] = (i << 16) | HUFF_LIT;
+		}
+	}
+} InflateSymbols;
+
+static const InflateSymbols& inflateSymbols() {
+	static const InflateSymbols symbols;
+	return symbols;
+}
+
+// Builds the decode table of a canonical Huffman code from its code lengths.
+// Codes of up to bits bits take one entry range of the primary table, longer
+// ones go to a second level table sized for the longest code of their prefix.
+// Fails on an over-subscribed code, an incomplete one leaves invalid entries.
+static bool buildHuffTable(uint32_t* table, unsigned bits, const uint8_t* lens, unsigned n, const uint32_t* symbols) {
+	unsigned count[16] = { 0 };
+	for (unsigned i = 0; i < n; i++) {
+		count[lens[i]]++;
+	}
+	count[0] = 0;
+	int left = 1;
+	uint16_t next[16];
+	unsigned code = 0;
+	for (unsigned len = 1; len < 16; len++) {
+		left = (left << 1) - count[len];
+		if (left < 0) {
+			return false;
+		}
+		code = (code + count[len - 1]) << 1;
+		next[len] = code;
+	}
+
+	// Codes are stored bit reversed, deflate reads them from the low bit on
+	uint16_t rev[288];
+	uint8_t subBits[1 << INFLATE_LIT_BITS] = { 0 };
+	unsigned mask = (1u << bits) - 1;
+	for (unsigned i = 0; i < n; i++) {
+		unsigned len = lens[i];
+		if (len == 0) {
+			continue;
+		}
+		unsigned c = next[len]++, r = 0;
+		for (unsigned b = 0; b < len; b++) {
+			r = (r << 1) | ((c >> b) & 1);
+		}
+		rev[i] = r;
+		if (len > bits) {
+			subBits[r & mask] = std::max(subBits[r & mask], (uint8_t) (len - bits));
+		}
+	}
+
+	memset(table, 0, sizeof(uint32_t) << bits);
+	uint32_t offset = 1u << bits;
+	for (unsigned p = 0; p <= mask; p++) {
+		if (subBits[p]) {
+			table[p] = (offset << 16) | HUFF_SUB | (subBits[p] << 8) | bits;
+			memset(table + offset, 0, sizeof(uint32_t) << subBits[p]);
+			offset += 1u << subBits[p];
+		}
+	}
+
+	for (unsigned i = 0; i < n; i++) {
+		unsigned len = lens[i];
+		if (len == 0) {
+			continue;
+		}
+		if (len <= bits) {
+			for (unsigned k = rev[i]; k <= mask; k += 1u << len) {
+				table[k] = symbols[i] | len;
+			}
+		} else {
+			uint32_t sub = table[rev[i] & mask];
+			uint32_t* t = table + (sub >> 16);
+			unsigned size = 1u << ((sub >> 8) & 15);
+			for (unsigned k = rev[i] >> bits; k < size; k += 1u << (len - bits)) {
+				t[k] = symbols[i] | (len - bits);
+			}
+		}
+	}
+	return true;
+}
+
+typedef struct {
+	const uint8_t* in;
+	const uint8_t* end;
+	uint64_t bits;		// next input bits, the lowest first
+	unsigned n;			// number of valid bits
+	size_t over;		// zero bytes fed past the end of the input
+	uint8_t* out;		// lodepng_realloc'ed, cap bytes
+	size_t pos, cap, max;
+} Inflater;
+
+// Tops the bit buffer up to at least 56 bits
+static inline void refill(Inflater& z) {
+	if (z.end - z.in >= 8) {
+		uint64_t w;
+		memcpy(&w, z.in, 8);
+		z.bits |= w << z.n;
+		z.in += (63 - z.n) >> 3;
+		z.n |= 56;
+	} else {
+		while (z.n <= 56) {
+			uint64_t b = 0;
+			if (z.in < z.end) {
+				b = *z.in++;
+			} else {
+				z.over++;
+			}
+			z.bits |= b << z.n;
+			z.n += 8;
+		}
+	}
+}
+
+static inline uint32_t takeBits(Inflater& z, unsigned count) {
+	uint32_t v = (uint32_t) (z.bits & ((1ull << count) - 1));
+	z.bits >>= count;
+	z.n -= count;
+	return v;
+}
+
+static inline uint32_t decodeSymbol(Inflater& z, const uint32_t* table, unsigned bits) {
+	uint32_t e = table[z.bits & ((1u << bits) - 1)];
+	if (e & HUFF_SUB) {
+		takeBits(z, bits);
+		e = table[(e >> 16) + (z.bits & ((1u << ((e >> 8) & 15)) - 1))];
+	}
+	takeBits(z, e & 31);
+	return e;
+}
+
+// Makes room for need more output bytes plus the copy slack
+static bool reserveOutput(Inflater& z, size_t need) {
+	if (z.cap - z.pos >= need + INFLATE_SLACK) {
+		return true;
+	}
+	size_t cap = std::max(z.cap * 2, z.pos + need + INFLATE_SLACK);
+	uint8_t* out = (uint8_t*) lodepng_realloc(z.out, cap);
+	if (!out) {
+		return false;
+	}
+	z.out = out;
+	z.cap = cap;
+	return true;
+}
+
+// Copies a match of len bytes from dist bytes back, the slack past the
+// output lets the wide copies overshoot
+static inline void copyMatch(uint8_t* dst, size_t dist, size_t len) {
+	const uint8_t* src = dst - dist;
+	if (dist >= 8) {
+		uint8_t* end = dst + len;
+		do {
+			memcpy(dst, src, 8);
+			dst += 8;
+			src += 8;
+		} while (dst < end);
+	} else if (dist == 1) {
+		memset(dst, *src, len);
+	} else {
+		for (size_t k = 0; k < len; k++) {
+			dst[k] = src[k];
+		}
+	}
+}
+
+#define INFLATE_END	1000	// inflateSymbol found the end of block code
+
+// Decodes one literal or match, the bit buffer must hold 48 bits and the
+// output have room for a match. Returns 0, INFLATE_END or a lodepng error code.
+static inline unsigned inflateSymbol(Inflater& z, const uint32_t* lit, const uint32_t* dist) {
+	uint32_t e = decodeSymbol(z, lit, INFLATE_LIT_BITS);
+	if (e & HUFF_LIT) {
+		z.out[z.pos++] = (uint8_t) (e >> 16);
+		return 0;
+	}
+	if (e & HUFF_EOB) {
+		return INFLATE_END;
+	}
+	if ((e >> 16) == 0) {
+		return 16;	// invalid literal/length code
+	}
+	size_t len = (e >> 16) + takeBits(z, (e >> 8) & 15);
+	e = decodeSymbol(z, dist, INFLATE_DIST_BITS);
+	if ((e >> 16) == 0) {
+		return 18;	// invalid distance code
+	}
+	size_t d = (e >> 16) + takeBits(z, (e >> 8) & 15);
+	if (d > z.pos) {
+		return 52;	// distance before the start of the output
+	}
+	copyMatch(z.out + z.pos, d, len);
+	z.pos += len;
+	return 0;
+}
+
+// Decodes one Huffman coded block, returns 0 or a lodepng error code
+static unsigned inflateBlock(Inflater& z, const uint32_t* lit, const uint32_t* dist) {
+	for (;;) {
+		// Runs on a local copy the compiler keeps in registers (stores to the
+		// output could alias z), as long as no bound needs checking
+		Inflater f = z;
+		unsigned r = 0;
+		while (r == 0 && f.end - f.in >= 8 && f.cap - f.pos >= INFLATE_MAX_MATCH + INFLATE_SLACK) {
+			refill(f);
+			r = inflateSymbol(f, lit, dist);
+		}
+		z = f;
+		if (r == 0) {
+			// Near the end of the input or output
+			refill(z);
+			if (z.over > 8) {
+				return 51;	// read past the end of the data
+			}
+			if (!reserveOutput(z, INFLATE_MAX_MATCH)) {
+				return 83;
+			}
+			r = inflateSymbol(z, lit, dist);
+		}
+		if (r) {
+			return r == INFLATE_END ? 0 : r;
+		}
+	}
+}
+
+// Reads the code lengths of a dynamic block and builds its tables
+static unsigned readDynamicTables(Inflater& z, uint32_t* lit, uint32_t* dist) {
+	const InflateSymbols& sym = inflateSymbols();
+	refill(z);
+	unsigned hlit = takeBits(z, 5) + 257;
+	unsigned hdist = takeBits(z, 5) + 1;
+	unsigned hclen = takeBits(z, 4) + 4;
+	if (hlit > 286 || hdist > 30) {
+		return hlit > 286 ? 12 : 13;
+	}
+
+	uint8_t clens[19] = { 0 };
+	for (unsigned i = 0; i < hclen; i++) {
+		refill(z);
+		clens[CL_ORDER[i]] = takeBits(z, 3);
+	}
+	uint32_t cl[1 << INFLATE_CL_BITS];
+	if (!buildHuffTable(cl, INFLATE_CL_BITS, clens, 19, sym.cl)) {
+		return 16;
+	}
+
+	uint8_t lens[288 + 32] = { 0 };
+	unsigned total = hlit + hdist;
+	for (unsigned i = 0; i < total;) {
+		refill(z);
+		if (z.over > 8) {
+			return 50;
+		}
+		uint32_t e = decodeSymbol(z, cl, INFLATE_CL_BITS);
+		if (e == 0) {
+			return 16;
+		}
+		unsigned s = e >> 16;
+		if (s < 16) {
+			lens[i++] = s;
+			continue;
+		}
+		unsigned rep;
+		uint8_t value = 0;
+		if (s == 16) {
+			if (i == 0) {
+				return 54;	// repeat with no previous length
+			}
+			value = lens[i - 1];
+			rep = 3 + takeBits(z, 2);
+		} else if (s == 17) {
+			rep = 3 + takeBits(z, 3);
+		} else {
+			rep = 11 + takeBits(z, 7);
+		}
+		if (i + rep > total) {
+			return 13;
+		}
+		memset(lens + i, value, rep);
+		i += rep;
+	}
+	if (lens[256] == 0) {
+		return 64;	// no end code
+	}
+	if (!buildHuffTable(lit, INFLATE_LIT_BITS, lens, hlit, sym.lit) || !buildHuffTable(dist, INFLATE_DIST_BITS, lens + hlit, hdist, sym.dist)) {
+		return 55;
+	}
+	return 0;
+}
+
+typedef struct FixedTables {
+	uint32_t lit[1 << INFLATE_LIT_BITS], dist[1 << INFLATE_DIST_BITS];
+	FixedTables() {
+		uint8_t lens[288];
+		memset(lens, 8, 144);
+		memset(lens + 144, 9, 112);
+		memset(lens + 256, 7, 24);
+		memset(lens + 280, 8, 8);
+		buildHuffTable(lit, INFLATE_LIT_BITS, lens, 288, inflateSymbols().lit);
+		memset(lens, 5, 32);
+		buildHuffTable(dist, INFLATE_DIST_BITS, lens, 32, inflateSymbols().dist);
+	}
+} FixedTables;
+
+// Copies a stored block, it starts at the next byte boundary
+static unsigned storedBlock(Inflater& z, const LodePNGDecompressSettings* settings) {
+	// Hand back the whole bytes still in the bit buffer
+	takeBits(z, z.n & 7);
+	size_t back = z.n >> 3;
+	if (back <= z.over) {
+		z.over -= back;
+	} else {
+		z.in -= back - z.over;
+		z.over = 0;
+	}
+	z.bits = 0;
+	z.n = 0;
+	if (z.over || z.end - z.in < 4) {
+		return 52;
+	}
+	unsigned len = readU16le(z.in), nlen = readU16le(z.in + 2);
+	z.in += 4;
+	if (!settings->ignore_nlen && len + nlen != 65535) {
+		return 21;
+	}
+	if ((size_t) (z.end - z.in) < len) {
+		return 23;
+	}
+	if (!reserveOutput(z, len)) {
+		return 83;
+	}
+	memcpy(z.out + z.pos, z.in, len);
+	z.pos += len;
+	z.in += len;
+	return 0;
+}
+
+static unsigned inflateStream(Inflater& z, const LodePNGDecompressSettings* settings) {
+	static const FixedTables fixed;
+	uint32_t lit[INFLATE_LIT_SIZE], dist[INFLATE_DIST_SIZE];
+	for (;;) {
+		refill(z);
+		unsigned final = takeBits(z, 1);
+		unsigned type = takeBits(z, 2);
+		unsigned err;
+		if (type == 0) {
+			err = storedBlock(z, settings);
+		} else if (type == 1) {
+			err = inflateBlock(z, fixed.lit, fixed.dist);
+		} else if (type == 2) {
+			err = readDynamicTables(z, lit, dist);
+			if (!err) {
+				err = inflateBlock(z, lit, dist);
+			}
+		} else {
+			err = 20;	// invalid block type
+		}
+		if (err) {
+			return err;
+		}
+		if (z.over * 8 > z.n) {
+			return 51;	// used bits past the end of the data
+		}
+		if (z.max && z.pos > z.max) {
+			return 109;
+		}
+		if (final) {
+			return 0;
+		}
+	}
+}
+
+static uint32_t adler32(const uint8_t* data, size_t len) {
+	uint32_t a = 1, b = 0;
+	while (len > 0) {
+		// Largest run that can not overflow b before the modulo
+		size_t n = std::min(len, (size_t) 5552);
+		len -= n;
+		for (; n >= 8; n -= 8, data += 8) {
+			a += data[0]; b += a;
+			a += data[1]; b += a;
+			a += data[2]; b += a;
+			a += data[3]; b += a;
+			a += data[4]; b += a;
+			a += data[5]; b += a;
+			a += data[6]; b += a;
+			a += data[7]; b += a;
+		}
+		for (; n > 0; n--) {
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+// custom_zlib hook. custom_context may point to the expected output size
+// (a size_t), the output is then allocated once.
+unsigned sffZlibDecompress(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize, const LodePNGDecompressSettings* settings) {
+	if (insize < 2) {
+		return 53;
+	}
+	if ((in[0] * 256 + in[1]) % 31 != 0) {
+		return 24;
+	}
+	if ((in[0] & 15) != 8 || (in[0] >> 4) > 7) {
+		return 25;
+	}
+	if ((in[1] >> 5) & 1) {
+		return 26;	// preset dictionary
+	}
+
+	// Deflate can not expand more than 1032 times, a wrong hint costs nothing
+	size_t expected = settings->custom_context ? *(const size_t*) settings->custom_context : 0;
+	expected = std::min(expected, insize * 1032);
+	Inflater z = { in + 2, in + insize, 0, 0, 0, NULL, 0, 0, settings->max_output_size };
+	if (!reserveOutput(z, expected ? expected : insize * 4)) {
+		return 83;
+	}
+	unsigned err = inflateStream(z, settings);
+	if (!err && !settings->ignore_adler32) {
+		if (insize < 6 || adler32(z.out, z.pos) != readU32be(in + insize - 4)) {
+			err = 58;
+		}
+	}
+	if (err) {
+		lodepng_free(z.out);
+		return err;
+	}
+	*out = z.out;
+	*outsize = z.pos;
+	return 0;
+}
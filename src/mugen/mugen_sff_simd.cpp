@@ -0,0 +1,230 @@
+#include "mugen_sff.h"
+
+// Vectorized sprite kernels, chosen at runtime from the CPU features.
+// Every kernel gives the same bytes as the scalar reference.
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SFF_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// RLE8
+//
+// A byte 01nnnnnn is a run of n copies of the next byte, any other byte is a
+// literal pixel. Once the input is used up the rest of the sprite repeats its
+// last byte, like the original decoder which stopped advancing at the end.
+
+// Byte at a time, as the decoder always did. Kept to check the others against.
+void rle8DecodeReference(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen) {
+	size_t i = 0, j = 0;
+	while (j < dstLen) {
+		long n = 1;
+		bool last = i == srcLen - 1;
+		uint8_t d = src[i];
+		if (i < (srcLen - 1)) {
+			i++;
+		}
+		if ((d & 0xc0) == 0x40) {
+			n = d & 0x3f;
+			d = src[i];
+			if (i < (srcLen - 1)) {
+				i++;
+			}
+			// An empty run as last byte would never move on
+			if (n == 0 && last) {
+				n = 1;
+			}
+		}
+		for (; n > 0; n--) {
+			if (j < dstLen) {
+				dst[j] = d;
+				j++;
+			}
+		}
+	}
+}
+
+// Decodes from src[i] / dst[j] on, bounds are checked once per run or literal stretch
+static void rle8DecodeFrom(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen, size_t i, size_t j) {
+	while (i < srcLen && j < dstLen) {
+		uint8_t d = src[i];
+		if ((d & 0xc0) == 0x40) {
+			if (i + 1 >= srcLen) {
+				break;
+			}
+			size_t n = std::min((size_t) (d & 0x3f), dstLen - j);
+			memset(dst + j, src[i + 1], n);
+			j += n;
+			i += 2;
+		} else {
+			size_t end = std::min(srcLen, i + (dstLen - j));
+			size_t k = i + 1;
+			while (k < end && (src[k] & 0xc0) != 0x40) {
+				k++;
+			}
+			memcpy(dst + j, src + i, k - i);
+			j += k - i;
+			i = k;
+		}
+	}
+	if (j < dstLen) {
+		memset(dst + j, src[srcLen - 1], dstLen - j);
+	}
+}
+
+void rle8DecodeScalar(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen) {
+	rle8DecodeFrom(src, srcLen, dst, dstLen, 0, 0);
+}
+
+#ifdef SFF_SIMD_X86
+// Runs (at most 63 bytes) are written as 64 bytes and literals as a full
+// vector, the bytes past the end are overwritten by what follows. The loop
+// stops where that could go past either buffer, the scalar code ends it.
+__attribute__((target("sse2")))
+static void rle8DecodeSse2(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen) {
+	const __m128i mask = _mm_set1_epi8((char) 0xc0);
+	const __m128i marker = _mm_set1_epi8(0x40);
+	size_t i = 0, j = 0;
+	while (i + 16 <= srcLen && j + 64 <= dstLen) {
+		uint8_t d = src[i];
+		if ((d & 0xc0) == 0x40) {
+			__m128i v = _mm_set1_epi8((char) src[i + 1]);
+			_mm_storeu_si128((__m128i*) (dst + j), v);
+			_mm_storeu_si128((__m128i*) (dst + j + 16), v);
+			_mm_storeu_si128((__m128i*) (dst + j + 32), v);
+			_mm_storeu_si128((__m128i*) (dst + j + 48), v);
+			j += d & 0x3f;
+			i += 2;
+		} else {
+			__m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+			unsigned runs = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, mask), marker));
+			size_t n = runs ? __builtin_ctz(runs) : 16;
+			_mm_storeu_si128((__m128i*) (dst + j), v);
+			i += n;
+			j += n;
+		}
+	}
+	rle8DecodeFrom(src, srcLen, dst, dstLen, i, j);
+}
+
+__attribute__((target("avx2")))
+static void rle8DecodeAvx2(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen) {
+	const __m256i mask = _mm256_set1_epi8((char) 0xc0);
+	const __m256i marker = _mm256_set1_epi8(0x40);
+	size_t i = 0, j = 0;
+	while (i + 32 <= srcLen && j + 64 <= dstLen) {
+		uint8_t d = src[i];
+		if ((d & 0xc0) == 0x40) {
+			__m256i v = _mm256_set1_epi8((char) src[i + 1]);
+			_mm256_storeu_si256((__m256i*) (dst + j), v);
+			_mm256_storeu_si256((__m256i*) (dst + j + 32), v);
+			j += d & 0x3f;
+			i += 2;
+		} else {
+			__m256i v = _mm256_loadu_si256((const __m256i*) (src + i));
+			unsigned runs = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, mask), marker));
+			size_t n = runs ? __builtin_ctz(runs) : 32;
+			_mm256_storeu_si256((__m256i*) (dst + j), v);
+			i += n;
+			j += n;
+		}
+	}
+	rle8DecodeFrom(src, srcLen, dst, dstLen, i, j);
+}
+#endif
+
+// Kernels this CPU can run, the reference first and the fastest last
+std::vector<DecodeKernel> rle8Kernels() {
+	std::vector<DecodeKernel> kernels = { { "reference", rle8DecodeReference }, { "scalar", rle8DecodeScalar } };
+#ifdef SFF_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		kernels.push_back({ "sse2", rle8DecodeSse2 });
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		kernels.push_back({ "avx2", rle8DecodeAvx2 });
+	}
+#endif
+	return kernels;
+}
+
+// Palette expansion
+//
+// 8-bit indices to RGBA pixels through a 256 color palette, the lookup the
+// paletted sprite shader does on the GPU. Palette entries and pixels are
+// R, G, B, A bytes (uint32_t little-endian, like generateTextureFromPaletteRGBA).
+
+void expandPaletteReference(const uint8_t* px, size_t n, const uint32_t* pal_rgba, uint32_t* rgba) {
+	for (size_t i = 0; i < n; i++) {
+		rgba[i] = pal_rgba[px[i]];
+	}
+}
+
+// Eight indices per load
+void expandPaletteScalar(const uint8_t* px, size_t n, const uint32_t* pal_rgba, uint32_t* rgba) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t v;
+		memcpy(&v, px + i, 8);
+		rgba[i + 0] = pal_rgba[v & 0xff];
+		rgba[i + 1] = pal_rgba[(v >> 8) & 0xff];
+		rgba[i + 2] = pal_rgba[(v >> 16) & 0xff];
+		rgba[i + 3] = pal_rgba[(v >> 24) & 0xff];
+		rgba[i + 4] = pal_rgba[(v >> 32) & 0xff];
+		rgba[i + 5] = pal_rgba[(v >> 40) & 0xff];
+		rgba[i + 6] = pal_rgba[(v >> 48) & 0xff];
+		rgba[i + 7] = pal_rgba[v >> 56];
+	}
+	expandPaletteReference(px + i, n - i, pal_rgba, rgba + i);
+}
+
+#ifdef SFF_SIMD_X86
+// 32 indices widened to 4 x 8 lanes, each looked up with one gather
+__attribute__((target("avx2")))
+static void expandPaletteAvx2(const uint8_t* px, size_t n, const uint32_t* pal_rgba, uint32_t* rgba) {
+	const int* pal = (const int*) pal_rgba;
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (px + i));
+		__m128i lo = _mm256_castsi256_si128(v);
+		__m128i hi = _mm256_extracti128_si256(v, 1);
+		__m256i a = _mm256_i32gather_epi32(pal, _mm256_cvtepu8_epi32(lo), 4);
+		__m256i b = _mm256_i32gather_epi32(pal, _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)), 4);
+		__m256i c = _mm256_i32gather_epi32(pal, _mm256_cvtepu8_epi32(hi), 4);
+		__m256i d = _mm256_i32gather_epi32(pal, _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)), 4);
+		_mm256_storeu_si256((__m256i*) (rgba + i), a);
+		_mm256_storeu_si256((__m256i*) (rgba + i + 8), b);
+		_mm256_storeu_si256((__m256i*) (rgba + i + 16), c);
+		_mm256_storeu_si256((__m256i*) (rgba + i + 24), d);
+	}
+	expandPaletteScalar(px + i, n - i, pal_rgba, rgba + i);
+}
+#endif
+
+// Kernels this CPU can run, the reference first and the fastest last
+std::vector<PaletteKernel> paletteKernels() {
+	std::vector<PaletteKernel> kernels = { { "reference", expandPaletteReference }, { "scalar", expandPaletteScalar } };
+#ifdef SFF_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernels.push_back({ "avx2", expandPaletteAvx2 });
+	}
+#endif
+	return kernels;
+}
+
+// Expands n indices with the fastest kernel of the CPU
+void expandPalette(const uint8_t* px, size_t n, const uint32_t* pal_rgba, uint32_t* rgba) {
+	static const PaletteKernel best = paletteKernels().back();
+	best.expand(px, n, pal_rgba, rgba);
+}
+
+// RGBA pixels of a paletted sprite (Size[0] x Size[1] indices, as decoded)
+// into rgba, which holds as many uint32_t. Returns -1 for RGBA sprites.
+int expandSpritePalette(const Sprite& s, const uint8_t* px, const uint32_t pal_rgba[256], uint32_t* rgba) {
+	if (s.rle == -11 || s.rle == -12) {
+		return -1;
+	}
+	expandPalette(px, (size_t) s.Size[0] * s.Size[1], pal_rgba, rgba);
+	return 0;
+}
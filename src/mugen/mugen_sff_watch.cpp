@@ -0,0 +1,97 @@
+#include "mugen_sff.h"
+#include <filesystem>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#define WATCH_POLL_MS 500
+
+#ifndef __linux__
+static void fileStamp(const std::string& path, uint64_t* size, int64_t* mtime) {
+	std::error_code ec;
+	*size = std::filesystem::file_size(path, ec);
+	if (ec) *size = 0;
+	auto t = std::filesystem::last_write_time(path, ec);
+	*mtime = ec ? 0 : (int64_t) t.time_since_epoch().count();
+}
+#endif
+
+bool FileWatcher::start(const char* filename) {
+	stop();
+	std::error_code ec;
+	std::filesystem::path p = std::filesystem::absolute(filename, ec);
+	if (ec) {
+		return false;
+	}
+#ifdef __linux__
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Error: can not watch %s\n", filename);
+		return false;
+	}
+	// Only completed writes: a half written file would fail to parse
+	if (inotify_add_watch(fd, p.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		fprintf(stderr, "Error: can not watch %s\n", filename);
+		stop();
+		return false;
+	}
+	name = p.filename().string();
+#else
+	path = p.string();
+	fileStamp(path, &size, &mtime);
+	lastPoll = std::chrono::steady_clock::now();
+#endif
+	return true;
+}
+
+void FileWatcher::stop() {
+#ifdef __linux__
+	if (fd >= 0) {
+		::close(fd);
+	}
+	fd = -1;
+#else
+	path.clear();
+#endif
+}
+
+bool FileWatcher::changed() {
+	bool hit = false;
+#ifdef __linux__
+	if (fd < 0) {
+		return false;
+	}
+	alignas(struct inotify_event) char buf[4096];
+	for (;;) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n <= 0) {
+			break;
+		}
+		for (char* p = buf; p < buf + n;) {
+			const struct inotify_event* ev = (const struct inotify_event*) p;
+			if (ev->len && name == ev->name) {
+				hit = true;
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+#else
+	if (path.empty()) {
+		return false;
+	}
+	auto now = std::chrono::steady_clock::now();
+	if (std::chrono::duration_cast<std::chrono::milliseconds>(now - lastPoll).count() < WATCH_POLL_MS) {
+		return false;
+	}
+	lastPoll = now;
+	uint64_t newSize;
+	int64_t newTime;
+	fileStamp(path, &newSize, &newTime);
+	if (newSize != size || newTime != mtime) {
+		size = newSize;
+		mtime = newTime;
+		hit = newSize > 0;
+	}
+#endif
+	return hit;
+}